@@ -0,0 +1,259 @@
+#include "alignment_cost.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include "common.hpp"
+
+AlignmentCost::AlignmentCost(ImageView<const FloatPixel> ref,
+                             ImageView<const FloatPixel> alt, int tile_size)
+    : ref_(ref),
+      alt_(alt),
+      tile_size_(tile_size),
+      stride_(tile_size / 2),
+      rows_(NumTiles(ref.height(), tile_size)),
+      cols_(NumTiles(ref.width(), tile_size)) {}
+
+float AlignmentCost::WindowSsd(int top, int left, int height, int width,
+                               int dy, int dx) const {
+  const int row_begin = std::max(0, top);
+  const int row_end = std::min(ref_.height(), top + height);
+  const int col_begin = std::max(0, left);
+  const int col_end = std::min(ref_.width(), left + width);
+  // Columns whose displaced column is inside of the alternate image.
+  const int inside_begin = Clamp(-dx, col_begin, col_end);
+  const int inside_end = Clamp(alt_.width() - dx, inside_begin, col_end);
+  float sum = 0.f;
+  for (int row = row_begin; row < row_end; row++) {
+    const FloatPixel* ref_row = ref_.row(row);
+    const FloatPixel* alt_row = alt_.row(Clamp(row + dy, 0, alt_.height() - 1));
+    for (int col = col_begin; col < inside_begin; col++) {
+      const float d = ref_row[col].i - alt_row[0].i;
+      sum += d * d;
+    }
+    for (int col = inside_begin; col < inside_end; col++) {
+      const float d = ref_row[col].i - alt_row[col + dx].i;
+      sum += d * d;
+    }
+    for (int col = inside_end; col < col_end; col++) {
+      const float d = ref_row[col].i - alt_row[alt_.width() - 1].i;
+      sum += d * d;
+    }
+  }
+  return sum;
+}
+
+int AlignmentCost::TilePixels(int ty, int tx) const {
+  const int top = (ty - 1) * stride_;
+  const int left = (tx - 1) * stride_;
+  const int rows =
+      std::min(ref_.height(), top + tile_size_) - std::max(0, top);
+  const int cols =
+      std::min(ref_.width(), left + tile_size_) - std::max(0, left);
+  return std::max(0, rows) * std::max(0, cols);
+}
+
+float AlignmentCost::TileSsd(int ty, int tx, int dy, int dx) const {
+  return WindowSsd((ty - 1) * stride_, (tx - 1) * stride_, tile_size_,
+                   tile_size_, dy, dx);
+}
+
+void AlignmentCost::BlockCosts(int by,
+                               const std::vector<TileAlignment>& centers,
+                               int radius, BlockRow* blocks) const {
+  const int s = stride_;
+  const int num_blocks = cols_ + 1;
+  blocks->windows.resize(num_blocks);
+  size_t size = 0;
+  for (int bx = 0; bx < num_blocks; bx++) {
+    // Bounding box of the search windows of the tiles containing the block.
+    BlockRow::Window& window = blocks->windows[bx];
+    int y0 = std::numeric_limits<int>::max(), y1 = std::numeric_limits<int>::min();
+    int x0 = y0, x1 = y1;
+    for (int ty = std::max(0, by - 1); ty <= std::min(rows_ - 1, by); ty++) {
+      for (int tx = std::max(0, bx - 1); tx <= std::min(cols_ - 1, bx); tx++) {
+        const TileAlignment& center = centers[ty * cols_ + tx];
+        y0 = std::min(y0, center.dy - radius);
+        y1 = std::max(y1, center.dy + radius);
+        x0 = std::min(x0, center.dx - radius);
+        x1 = std::max(x1, center.dx + radius);
+      }
+    }
+    window.dy = y0;
+    window.dx = x0;
+    window.height = y1 - y0 + 1;
+    window.width = x1 - x0 + 1;
+    window.offset = size;
+    size += window.height * window.width;
+  }
+  blocks->costs.assign(size, 0.f);
+
+  const int row_begin = std::max(0, (by - 1) * s);
+  const int row_end = std::min(ref_.height(), by * s);
+  for (int bx = 0; bx < num_blocks; bx++) {
+    const BlockRow::Window& window = blocks->windows[bx];
+    const int col_begin = std::max(0, (bx - 1) * s);
+    const int col_end = std::min(ref_.width(), bx * s);
+    const int num_cols = col_end - col_begin;
+    if (num_cols <= 0) continue;
+    // Whether every displaced column is inside of the alternate image.
+    const bool inside = col_begin + window.dx >= 0 &&
+        col_end - 1 + window.dx + window.width - 1 < alt_.width();
+    for (int row = row_begin; row < row_end; row++) {
+      const FloatPixel* ref_row = ref_.row(row) + col_begin;
+      for (int i = 0; i < window.height; i++) {
+        const FloatPixel* alt_row =
+            alt_.row(Clamp(row + window.dy + i, 0, alt_.height() - 1));
+        float* costs = &blocks->costs[window.offset + i * window.width];
+        for (int j = 0; j < window.width; j++) {
+          const int dx = window.dx + j;
+          float sum = 0.f;
+          if (inside) {
+            const FloatPixel* alt = alt_row + col_begin + dx;
+            for (int k = 0; k < num_cols; k++) {
+              const float d = ref_row[k].i - alt[k].i;
+              sum += d * d;
+            }
+          } else {
+            for (int k = 0; k < num_cols; k++) {
+              const int col = Clamp(col_begin + k + dx, 0, alt_.width() - 1);
+              const float d = ref_row[k].i - alt_row[col].i;
+              sum += d * d;
+            }
+          }
+          costs[j] += sum;
+        }
+      }
+    }
+  }
+}
+
+std::vector<TileAlignment> AlignmentCost::BestOffsets(
+    const std::vector<TileAlignment>& centers, int radius,
+    Method method) const {
+  std::vector<float> best_ssd(rows_ * cols_,
+                              std::numeric_limits<float>::max());
+  std::vector<TileAlignment> best(rows_ * cols_);
+  auto consider = [&](int tile, int dy, int dx, float ssd) {
+    if (ssd < best_ssd[tile]) {
+      best_ssd[tile] = ssd;
+      best[tile].dy = dy;
+      best[tile].dx = dx;
+    }
+  };
+
+  if (method == Method::kBruteForce) {
+    for (int ty = 0; ty < rows_; ty++) {
+      for (int tx = 0; tx < cols_; tx++) {
+        const int tile = ty * cols_ + tx;
+        const TileAlignment& center = centers[tile];
+        for (int dy = center.dy - radius; dy <= center.dy + radius; dy++)
+          for (int dx = center.dx - radius; dx <= center.dx + radius; dx++)
+            consider(tile, dy, dx, TileSsd(ty, tx, dy, dx));
+      }
+    }
+  } else {
+    // Tile (ty, tx) is made of blocks (ty, tx) to (ty + 1, tx + 1) of a grid
+    // of half-tile blocks starting half a tile above and left of the image.
+    // Each block is summed once for every offset searched by any of the (up
+    // to 4) tiles containing it, and tile costs are sums of 4 block costs.
+    // Only the two block rows of the current tile row are kept.
+    BlockRow above;
+    BlockRow below;
+    BlockCosts(0, centers, radius, &above);
+    for (int ty = 0; ty < rows_; ty++) {
+      BlockCosts(ty + 1, centers, radius, &below);
+      for (int tx = 0; tx < cols_; tx++) {
+        const int tile = ty * cols_ + tx;
+        const TileAlignment& center = centers[tile];
+        for (int dy = center.dy - radius; dy <= center.dy + radius; dy++) {
+          for (int dx = center.dx - radius; dx <= center.dx + radius; dx++) {
+            consider(tile, dy, dx,
+                     above.Cost(tx, dy, dx) + above.Cost(tx + 1, dy, dx) +
+                     below.Cost(tx, dy, dx) + below.Cost(tx + 1, dy, dx));
+          }
+        }
+      }
+      std::swap(above, below);
+    }
+  }
+
+  for (int ty = 0; ty < rows_; ty++) {
+    for (int tx = 0; tx < cols_; tx++) {
+      const int tile = ty * cols_ + tx;
+      const int pixels = TilePixels(ty, tx);
+      best[tile].distance =
+          pixels > 0 ? std::sqrt(best_ssd[tile] / pixels) : 0.f;
+    }
+  }
+  return best;
+}
+
+void AlignmentCost::RefineSubpixel(int ty, int tx,
+                                   TileAlignment* alignment) const {
+  // Least squares fit of f(u, v) = a u^2 + b v^2 + c u v + d u + e v + g to
+  // the costs f[v + 1][u + 1] at horizontal and vertical displacements u and
+  // v in {-1, 0, 1} from the alignment. The sums below are its closed form
+  // solution, as in Section 4 and Supplement C of the HDR+ paper.
+  float f[3][3];
+  for (int v = -1; v <= 1; v++)
+    for (int u = -1; u <= 1; u++)
+      f[v + 1][u + 1] =
+          TileSsd(ty, tx, alignment->dy + v, alignment->dx + u);
+  const float second[3] = {1.f, -2.f, 1.f};
+  float a = 0.f, b = 0.f, c = 0.f, d = 0.f, e = 0.f;
+  for (int v = -1; v <= 1; v++) {
+    for (int u = -1; u <= 1; u++) {
+      const float value = f[v + 1][u + 1];
+      a += second[u + 1] * value / 6.f;
+      b += second[v + 1] * value / 6.f;
+      c += u * v * value / 4.f;
+      d += u * value / 6.f;
+      e += v * value / 6.f;
+    }
+  }
+  // The minimum is where the gradient (2 a u + c v + d, c u + 2 b v + e)
+  // vanishes, if the quadratic is convex.
+  const float det = 4.f * a * b - c * c;
+  if (a <= 0.f || b <= 0.f || det <= 0.f) return;
+  alignment->sub_dx = Clamp((c * e - 2.f * b * d) / det, -.5f, .5f);
+  alignment->sub_dy = Clamp((c * d - 2.f * a * e) / det, -.5f, .5f);
+}
+
+std::vector<TileAlignment> AlignTiles(const Pyramid& reference,
+                                      const Pyramid& frame, int tile_size,
+                                      int radius, AlignmentCost::Method method,
+                                      bool subpixel) {
+  const int num_levels = std::min(reference.num_levels(), frame.num_levels());
+  std::vector<TileAlignment> coarser;
+  int coarser_rows = 0;
+  int coarser_cols = 0;
+  for (int level = num_levels - 1; level >= 0; level--) {
+    const AlignmentCost cost(reference.level(level), frame.level(level),
+                             tile_size);
+    // Each tile starts from the upsampled alignment of the coarser tile
+    // with the same center.
+    std::vector<TileAlignment> centers(cost.rows() * cost.cols());
+    if (not coarser.empty()) {
+      for (int ty = 0; ty < cost.rows(); ty++) {
+        for (int tx = 0; tx < cost.cols(); tx++) {
+          const int cy = std::min((ty + 1) / 2, coarser_rows - 1);
+          const int cx = std::min((tx + 1) / 2, coarser_cols - 1);
+          centers[ty * cost.cols() + tx].dy =
+              2 * coarser[cy * coarser_cols + cx].dy;
+          centers[ty * cost.cols() + tx].dx =
+              2 * coarser[cy * coarser_cols + cx].dx;
+        }
+      }
+    }
+    coarser = cost.BestOffsets(centers, radius, method);
+    coarser_rows = cost.rows();
+    coarser_cols = cost.cols();
+    if (level == 0 && subpixel) {
+      for (int ty = 0; ty < cost.rows(); ty++)
+        for (int tx = 0; tx < cost.cols(); tx++)
+          cost.RefineSubpixel(ty, tx, &coarser[ty * cost.cols() + tx]);
+    }
+  }
+  return coarser;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include "image.hpp"
+#include "pixel.hpp"
+#include "pyramid.hpp"
+#include "view.hpp"
+
+// Alignment of one tile of a frame to the reference frame, in pixels of the
+// grayscale image the tile belongs to.
+struct TileAlignment {
+  int dy = 0;
+  int dx = 0;
+  // Sub-pixel refinement of (@dy, @dx), in [-.5, .5].
+  float sub_dy = 0.f;
+  float sub_dx = 0.f;
+  // Root mean square difference to the reference tile at (@dy, @dx).
+  float distance = 0.f;
+};
+
+// Sums of squared differences (L2 costs) between the tiles of a reference
+// image and displaced tiles of an alternate image. Tiles are @tile_size
+// pixels square and overlap by half: tile (ty, tx) has its top left pixel at
+// ((ty - 1) * tile_size / 2, (tx - 1) * tile_size / 2). Pixels of a tile
+// outside of the reference are skipped and pixels outside of the alternate
+// image are clamped.
+class AlignmentCost {
+ public:
+  enum class Method {
+    // Sums every tile at every offset separately.
+    kBruteForce,
+    // Sums each half-tile block once per offset and adds up four blocks per
+    // tile, i.e. a box filter over the block grid. Overlapping tiles share
+    // their blocks, so each pixel is summed once per offset instead of once
+    // per tile containing it. Costs match kBruteForce up to rounding.
+    kBoxFiltered,
+  };
+
+  // Number of tiles along a dimension of @size pixels.
+  static int NumTiles(int size, int tile_size) {
+    return (size + tile_size / 2 - 1) / (tile_size / 2) + 1;
+  }
+
+  // @ref and @alt must have the same size and outlive this object.
+  AlignmentCost(ImageView<const FloatPixel> ref,
+                ImageView<const FloatPixel> alt, int tile_size);
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+
+  // For every tile, the offset within @radius (in both dimensions) of the
+  // offset of @centers[tile] with the smallest cost. Ties go to the first
+  // offset in row major order.
+  std::vector<TileAlignment> BestOffsets(
+      const std::vector<TileAlignment>& centers, int radius,
+      Method method) const;
+
+  // Sum of squared differences of tile (@ty, @tx) displaced by (@dy, @dx).
+  float TileSsd(int ty, int tx, int dy, int dx) const;
+
+  // Refines @alignment of tile (@ty, @tx) to sub-pixel precision, by fitting
+  // a 2D quadratic to the costs of the 3x3 offsets around it and moving to
+  // its minimum (Section 4 of the HDR+ paper). Alignments where the fit has
+  // no minimum are left as they are.
+  void RefineSubpixel(int ty, int tx, TileAlignment* alignment) const;
+
+ private:
+  // Costs of one row of half-tile blocks (see BestOffsets()).
+  struct BlockRow {
+    // Offsets a block is summed for, a @height x @width window starting at
+    // (@dy, @dx), and where its costs start in @costs.
+    struct Window {
+      int dy;
+      int dx;
+      int height;
+      int width;
+      size_t offset;
+    };
+
+    float Cost(int bx, int dy, int dx) const {
+      const Window& window = windows[bx];
+      return costs[window.offset + (dy - window.dy) * window.width +
+                   (dx - window.dx)];
+    }
+
+    std::vector<Window> windows;
+    std::vector<float> costs;
+  };
+
+  // Sums block row @by for every offset searched by the tiles containing
+  // each block, given the search @centers and @radius of every tile.
+  void BlockCosts(int by, const std::vector<TileAlignment>& centers,
+                  int radius, BlockRow* blocks) const;
+
+  // Sum of squared differences of the @height x @width window of the
+  // reference at (@top, @left), clipped to the reference, and the window of
+  // the alternate image displaced by (@dy, @dx).
+  float WindowSsd(int top, int left, int height, int width, int dy,
+                  int dx) const;
+
+  // Number of reference pixels of tile (@ty, @tx).
+  int TilePixels(int ty, int tx) const;
+
+  const ImageView<const FloatPixel> ref_;
+  const ImageView<const FloatPixel> alt_;
+  const int tile_size_;
+  const int stride_;
+  const int rows_;
+  const int cols_;
+};
+
+// Aligns every tile of @frame to @reference, coarse to fine: each level
+// searches @radius pixels around the upsampled alignment of the coarser tile
+// with the same center. Tiles are @tile_size grayscale pixels at every level.
+// Returns the level 0 alignments, refined to sub-pixel precision if
+// @subpixel.
+std::vector<TileAlignment> AlignTiles(const Pyramid& reference,
+                                      const Pyramid& frame, int tile_size,
+                                      int radius, AlignmentCost::Method method,
+                                      bool subpixel);
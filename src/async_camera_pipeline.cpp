@@ -0,0 +1,98 @@
+#include "async_camera_pipeline.hpp"
+#include <algorithm>
+
+AsyncCameraPipeline::AsyncCameraPipeline(CameraPipelineInterface* pipeline,
+                                         const Opts& opts)
+    : pipeline_(pipeline),
+      opts_(opts),
+      readout_thread_(&AsyncCameraPipeline::ReadoutLoop, this),
+      process_thread_(&AsyncCameraPipeline::ProcessLoop, this) {}
+
+AsyncCameraPipeline::~AsyncCameraPipeline() {
+  // Closing the first queue drains the readout stage, which in turn closes
+  // the processing queue once it runs out of shots.
+  readout_queue_.Close();
+  readout_thread_.join();
+  process_thread_.join();
+}
+
+std::future<AsyncCameraPipeline::ImagePtr>
+AsyncCameraPipeline::TakePictureAsync() {
+  std::unique_ptr<Shot> shot(new Shot);
+  auto future = shot->result.get_future();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const int queue_depth = this->queue_depth();
+    if (in_flight_ >= queue_depth) {
+      if (opts_.backpressure == Backpressure::kReject) {
+        rejected_++;
+        shot->result.set_value(nullptr);
+        return future;
+      }
+      slot_free_.wait(lock, [&] { return in_flight_ < queue_depth; });
+    }
+    in_flight_++;
+  }
+  readout_queue_.Push(std::move(shot));
+  return future;
+}
+
+int AsyncCameraPipeline::queue_depth() const {
+  return std::max(1, opts_.queue_depth);
+}
+
+int AsyncCameraPipeline::in_flight() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return in_flight_;
+}
+
+int AsyncCameraPipeline::rejected() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return rejected_;
+}
+
+void AsyncCameraPipeline::ReadoutLoop() {
+  std::unique_ptr<Shot> shot;
+  while (readout_queue_.Pop(&shot)) {
+    try {
+      shot->readout = pipeline_->ReadoutShot();
+    } catch (...) {
+      shot->error = std::current_exception();
+    }
+    process_queue_.Push(std::move(shot));
+  }
+  process_queue_.Close();
+}
+
+void AsyncCameraPipeline::ProcessLoop() {
+  std::unique_ptr<Shot> shot;
+  while (process_queue_.Pop(&shot)) {
+    // Exceptions are forwarded to the shot's future rather than escaping
+    // the thread, which would terminate the program.
+    ImagePtr image;
+    std::exception_ptr error = shot->error;
+    if (not error) {
+      try {
+        image = pipeline_->ProcessReadout(std::move(shot->readout));
+      } catch (...) {
+        error = std::current_exception();
+      }
+    }
+    // Free the slot before publishing the result, so that a caller woken up
+    // by the future can queue its next shot without waiting.
+    Finished();
+    if (error) {
+      shot->result.set_exception(error);
+    } else {
+      shot->result.set_value(std::move(image));
+    }
+  }
+}
+
+void AsyncCameraPipeline::Finished() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_flight_--;
+  }
+  slot_free_.notify_one();
+}
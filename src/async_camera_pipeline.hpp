@@ -0,0 +1,85 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "blocking_queue.hpp"
+#include "camera_pipeline_interface.hpp"
+
+// Asynchronous front end for a CameraPipelineInterface. Shots run through two
+// stages on their own threads: sensor readout (ReadoutShot()) and processing
+// (ProcessReadout()). Readout of one shot therefore overlaps processing of
+// the previous one, and the caller is free to encode and write out older
+// results while both are running.
+class AsyncCameraPipeline {
+ public:
+  using ImagePtr = std::unique_ptr<Image<Rgb8Pixel>>;
+
+  // What TakePictureAsync() does when @queue_depth shots are in flight.
+  enum class Backpressure {
+    kBlock,   // Wait until the oldest in-flight shot finishes processing.
+    kReject,  // Return immediately with a future holding nullptr.
+  };
+
+  struct Opts {
+    // Maximum number of shots in flight, i.e. requested but not yet
+    // processed. Each one holds one readout's worth of sensor data.
+    int queue_depth = 3;
+    Backpressure backpressure = Backpressure::kBlock;
+  };
+
+  // @pipeline must outlive this object.
+  AsyncCameraPipeline(CameraPipelineInterface* pipeline, const Opts& opts);
+
+  // Finishes all in-flight shots before returning.
+  ~AsyncCameraPipeline();
+
+  // Queues a shot and returns a future for its processed image. Futures of
+  // accepted shots become ready in submission order; a shot rejected under
+  // Backpressure::kReject gets a future that is ready at once, holding
+  // nullptr. If the pipeline throws while reading out or processing a shot,
+  // its future rethrows the exception from get().
+  std::future<ImagePtr> TakePictureAsync();
+
+  // Maximum number of shots in flight: Opts::queue_depth, but at least 1.
+  int queue_depth() const;
+
+  // Number of shots requested but not yet processed.
+  int in_flight() const;
+
+  // Number of shots turned away under Backpressure::kReject.
+  int rejected() const;
+
+ private:
+  using T = typename CameraSensor::T;
+
+  struct Shot {
+    std::promise<ImagePtr> result;
+    std::unique_ptr<CameraSensorData<T>> readout;
+    std::exception_ptr error;  // thrown by ReadoutShot(), if anything.
+  };
+
+  void ReadoutLoop();
+  void ProcessLoop();
+  void Finished();
+
+  // Disallow copy and assign.
+  AsyncCameraPipeline(AsyncCameraPipeline&);
+  void operator=(const AsyncCameraPipeline&);
+
+  CameraPipelineInterface* const pipeline_;
+  const Opts opts_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable slot_free_;
+  int in_flight_ = 0;
+  int rejected_ = 0;
+
+  BlockingQueue<std::unique_ptr<Shot>> readout_queue_;
+  BlockingQueue<std::unique_ptr<Shot>> process_queue_;
+  std::thread readout_thread_;
+  std::thread process_thread_;
+};
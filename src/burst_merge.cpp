@@ -0,0 +1,173 @@
+#include "burst_merge.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "common.hpp"
+#include "kernel_tables.hpp"
+
+namespace {
+// Clamps @v to [0, @size - 1] while keeping its parity, so that clamped
+// coordinates stay on the same color of the Bayer mosaic.
+int ClampSamePhase(int v, int size) {
+  if (v < 0) return v & 1;
+  if (v >= size) return size - 2 + (v & 1);
+  return v;
+}
+}  // namespace
+
+BurstMerger::BurstMerger(std::unique_ptr<CameraSensorData<T>> reference,
+                         const Opts& opts)
+    : opts_(opts),
+      width_(reference->width()),
+      height_(reference->height()),
+      reference_pyramid_(width_, height_, opts.num_levels),
+      frame_pyramid_(width_, height_, opts.num_levels),
+      window_(kernel_tables::RaisedCosineWindow(opts.tile_size)),
+      merge_tile_(&BurstMerger::MergeTile<0>) {
+  reference_pyramid_.Build(reference->view());
+  if (opts_.specialized_kernels) {
+    switch (opts_.tile_size) {
+      case 8: merge_tile_ = &BurstMerger::MergeTile<8>; break;
+      case 16: merge_tile_ = &BurstMerger::MergeTile<16>; break;
+      case 32: merge_tile_ = &BurstMerger::MergeTile<32>; break;
+    }
+  }
+
+  // The reference is merged with full weight everywhere, and since the tile
+  // windows sum to 1, its contribution is just its own pixels.
+  sum_ = std::move(reference);
+  weight_.reset(new CameraSensorData<T>(width_, height_));
+  for (int row = 0; row < height_; row++)
+    for (int col = 0; col < width_; col++) weight_->data(row, col) = 1.f;
+}
+
+// static
+size_t BurstMerger::Bytes(int width, int height, const Opts& opts) {
+  // Two pyramids and the weight accumulator; the reference becomes the sum.
+  return 2 * Pyramid::Bytes(width, height, opts.num_levels) +
+      sizeof(T) * static_cast<size_t>(width) * height;
+}
+
+template<int kTileSize>
+void BurstMerger::MergeTile(SensorView<const T> frame, int top, int left,
+                            int dy, int dx, T fy, T fx, T tile_weight) {
+  static constexpr auto kWindow =
+      kernel_tables::RaisedCosineWindow<(kTileSize > 0 ? kTileSize : 1)>();
+  const int n = kTileSize > 0 ? kTileSize : opts_.tile_size;
+  const T* window = kTileSize > 0 ? kWindow.data() : window_.data();
+  const int i_begin = std::max(0, -top);
+  const int i_end = std::min(n, height_ - top);
+  const int j_begin = std::max(0, -left);
+  const int j_end = std::min(n, width_ - left);
+  // Whether every column sampled by the tile is inside of the frame, so
+  // that columns need no clamping.
+  const bool inside = left + j_begin + dx >= 0 &&
+      left + j_end - 1 + dx + 2 < width_;
+  const bool interpolate = fx > 0.f || fy > 0.f;
+  for (int i = i_begin; i < i_end; i++) {
+    const int row = top + i;
+    const T* alt_row0 = frame.row(ClampSamePhase(row + dy, height_));
+    const T* alt_row1 = frame.row(ClampSamePhase(row + dy + 2, height_));
+    const T row_weight = tile_weight * window[i];
+    T* sum = sum_->view().row(row) + left;
+    T* weight_sum = weight_->view().row(row) + left;
+    if (inside) {
+      const T* alt0 = alt_row0 + left + dx;
+      const T* alt1 = alt_row1 + left + dx;
+      if constexpr (kTileSize > 0) {
+        if (j_begin == 0 && j_end == kTileSize) {
+          // Whole rows of a specialized tile are sampled into a local
+          // buffer, then accumulated into the sums and the weights in
+          // separate passes. The passes are fixed size and none of them
+          // aliases another's output, so they vectorize.
+          T values[kTileSize];
+          if (interpolate) {
+            for (int j = 0; j < kTileSize; j++) {
+              values[j] =
+                  (1.f - fy) * ((1.f - fx) * alt0[j] + fx * alt0[j + 2]) +
+                  fy * ((1.f - fx) * alt1[j] + fx * alt1[j + 2]);
+            }
+          } else {
+            for (int j = 0; j < kTileSize; j++) values[j] = alt0[j];
+          }
+          for (int j = 0; j < kTileSize; j++)
+            sum[j] += row_weight * window[j] * values[j];
+          for (int j = 0; j < kTileSize; j++)
+            weight_sum[j] += row_weight * window[j];
+          continue;
+        }
+      }
+      for (int j = j_begin; j < j_end; j++) {
+        T value = alt0[j];
+        if (interpolate) {
+          value = (1.f - fy) * ((1.f - fx) * value + fx * alt0[j + 2]) +
+              fy * ((1.f - fx) * alt1[j] + fx * alt1[j + 2]);
+        }
+        const T weight = row_weight * window[j];
+        sum[j] += weight * value;
+        weight_sum[j] += weight;
+      }
+      continue;
+    }
+    for (int j = j_begin; j < j_end; j++) {
+      const int col = left + j;
+      const int alt_col0 = ClampSamePhase(col + dx, width_);
+      T value = alt_row0[alt_col0];
+      if (interpolate) {
+        const int alt_col1 = ClampSamePhase(col + dx + 2, width_);
+        value = (1.f - fy) * ((1.f - fx) * value + fx * alt_row0[alt_col1]) +
+            fy * ((1.f - fx) * alt_row1[alt_col0] + fx * alt_row1[alt_col1]);
+      }
+      const T weight = row_weight * window[j];
+      sum[j] += weight * value;
+      weight_sum[j] += weight;
+    }
+  }
+}
+
+void BurstMerger::AddFrame(SensorView<const T> frame) {
+  MergeAligned(frame, Align(frame));
+}
+
+std::vector<TileAlignment> BurstMerger::Align(SensorView<const T> frame) {
+  frame_pyramid_.Build(frame);
+  return AlignTiles(reference_pyramid_, frame_pyramid_, opts_.tile_size / 2,
+                    opts_.search_radius, opts_.align_method, opts_.subpixel);
+}
+
+void BurstMerger::MergeAligned(SensorView<const T> frame,
+                               const std::vector<TileAlignment>& alignments) {
+  const int n = opts_.tile_size;
+  const int stride = n / 2;
+  const int rows = AlignmentCost::NumTiles(height_ / 2, n / 2);
+  const int cols = AlignmentCost::NumTiles(width_ / 2, n / 2);
+  const T distance_range = std::max(1e-6f, opts_.max_distance - opts_.min_distance);
+  for (int ty = 0; ty < rows; ty++) {
+    for (int tx = 0; tx < cols; tx++) {
+      const TileAlignment& alignment = alignments[ty * cols + tx];
+      const T tile_weight = Clamp(
+          (opts_.max_distance - alignment.distance) / distance_range, 0.f, 1.f);
+      if (tile_weight <= 0.f) continue;
+
+      // Alignments are in grayscale pixels, i.e. whole Bayer quads, so a
+      // sub-pixel offset interpolates between photosites of the same color
+      // two raw pixels apart.
+      const T gray_dy = alignment.dy + alignment.sub_dy;
+      const T gray_dx = alignment.dx + alignment.sub_dx;
+      (this->*merge_tile_)(frame, ty * stride - stride, tx * stride - stride,
+                           2 * static_cast<int>(std::floor(gray_dy)),
+                           2 * static_cast<int>(std::floor(gray_dx)),
+                           gray_dy - std::floor(gray_dy),
+                           gray_dx - std::floor(gray_dx), tile_weight);
+    }
+  }
+  num_frames_++;
+}
+
+std::unique_ptr<CameraSensorData<typename BurstMerger::T>> BurstMerger::Finish() {
+  for (int row = 0; row < height_; row++)
+    for (int col = 0; col < width_; col++)
+      sum_->data(row, col) /= weight_->data(row, col);
+  weight_.reset();
+  return std::move(sum_);
+}
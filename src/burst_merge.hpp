@@ -0,0 +1,88 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "alignment_cost.hpp"
+#include "camera_sensor.hpp"
+#include "pyramid.hpp"
+
+// Incremental align-and-merge of a burst of Bayer frames, after Sections 4
+// and 5 of the HDR+ paper. The merger holds the reference frame, its
+// grayscale pyramid and two running accumulators; every other frame is
+// aligned to the reference and folded into the accumulators as soon as it is
+// added, so memory use does not depend on the length of the burst.
+class BurstMerger {
+ public:
+  using T = typename CameraSensor::T;
+
+  struct Opts {
+    // Merge tiles are @tile_size x @tile_size raw pixels and overlap by half
+    // a tile. Must be a multiple of 4.
+    int tile_size = 16;
+    // Search radius of the hierarchical alignment at each pyramid level, in
+    // pixels of that level.
+    int search_radius = 4;
+    int num_levels = 4;
+    AlignmentCost::Method align_method = AlignmentCost::Method::kBoxFiltered;
+    // Refine alignments to sub-pixel precision and resample frames
+    // bilinearly (within each color of the mosaic) when merging.
+    bool subpixel = true;
+    // Aligned tiles whose root mean square grayscale difference to the
+    // reference is below @min_distance are merged with full weight, and tiles
+    // above @max_distance are rejected.
+    T min_distance = .02f;
+    T max_distance = .06f;
+    // Merge with the kernel specialized at compile time for @tile_size, if
+    // there is one (8, 16 or 32). Otherwise, or if false, a generic kernel
+    // gives the same results more slowly.
+    bool specialized_kernels = true;
+  };
+
+  BurstMerger(std::unique_ptr<CameraSensorData<T>> reference, const Opts& opts);
+
+  // Aligns @frame to the reference and merges it. @frame must have the same
+  // size as the reference and can be reused as soon as this returns.
+  // Equivalent to MergeAligned(frame, Align(frame)).
+  void AddFrame(SensorView<const T> frame);
+
+  // Alignments of the tiles of @frame to the reference.
+  std::vector<TileAlignment> Align(SensorView<const T> frame);
+
+  // Merges @frame, whose tiles are aligned by @alignments.
+  void MergeAligned(SensorView<const T> frame,
+                    const std::vector<TileAlignment>& alignments);
+
+  // Number of frames merged so far, including the reference.
+  int num_frames() const { return num_frames_; }
+
+  // Returns the merged Bayer frame. The merger can't be used afterwards.
+  std::unique_ptr<CameraSensorData<T>> Finish();
+
+  // Bytes a merger of @width x @height frames allocates on top of the
+  // reference frame it is given.
+  static size_t Bytes(int width, int height, const Opts& opts);
+
+ private:
+  // Adds @frame, displaced by (@dy, @dx) plus the fraction (@fy, @fx) of two
+  // pixels, to the merge tile at (@top, @left) with weight @tile_weight.
+  // kTileSize is the tile size if > 0, or 0 for the generic kernel.
+  template<int kTileSize>
+  void MergeTile(SensorView<const T> frame, int top, int left, int dy, int dx,
+                 T fy, T fx, T tile_weight);
+
+  using MergeTileKernel = void (BurstMerger::*)(SensorView<const T> frame,
+                                                int top, int left, int dy,
+                                                int dx, T fy, T fx,
+                                                T tile_weight);
+
+  const Opts opts_;
+  const int width_;
+  const int height_;
+  Pyramid reference_pyramid_;
+  Pyramid frame_pyramid_;  // of the frame being added, reused across frames.
+  std::vector<T> window_;  // 1D raised cosine window of a merge tile.
+  MergeTileKernel merge_tile_;
+  std::unique_ptr<CameraSensorData<T>> sum_;     // sum of weighted pixels.
+  std::unique_ptr<CameraSensorData<T>> weight_;  // sum of weights.
+  int num_frames_ = 1;
+};
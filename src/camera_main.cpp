@@ -1,9 +1,311 @@
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <random>
+#include <sstream>
+#include "alignment_cost.hpp"
+#include "async_camera_pipeline.hpp"
 #include "camera_sensor.hpp"
 #include "camera_pipeline.hpp"
 #include "camera_pipeline_interface.hpp"
 #include "common.hpp"
+#include "memory_stats.hpp"
+#include "pyramid.hpp"
+#include "render_farm.hpp"
+#include "sensor_calibration.hpp"
+#include "shared_scene.hpp"
+#include "stage_cache.hpp"
+#include "video_pipeline.hpp"
+
+namespace {
+// Returns @outfile with @index inserted before its extension.
+std::string NumberedFilename(const std::string& outfile, int index) {
+  const size_t dot = outfile.find_last_of('.');
+  const size_t slash = outfile.find_last_of('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return outfile + "_" + std::to_string(index);
+  return outfile.substr(0, dot) + "_" + std::to_string(index) +
+      outfile.substr(dot);
+}
+
+// Parses the comma separated numbers of @arg, or returns {@default_value} if
+// it is empty.
+std::vector<float> ParseList(const std::string& arg, float default_value) {
+  std::vector<float> values;
+  std::istringstream in(arg);
+  std::string value;
+  while (std::getline(in, value, ','))
+    if (not value.empty()) values.push_back(std::atof(value.c_str()));
+  if (values.empty()) values.push_back(default_value);
+  return values;
+}
+
+// Renders the shot of @pipeline with every output option in @variants,
+// writing variant i to NumberedFilename(outfile, i). With a stage cache, only
+// the first variant reads out and merges the burst.
+int RenderVariants(CameraPipeline* pipeline, const std::string& outfile,
+                   const std::vector<OutputStage::Opts>& variants) {
+  for (size_t i = 0; i < variants.size(); i++) {
+    pipeline->SetOutputOpts(variants[i]);
+    Timer timer;
+    auto image = pipeline->TakePicture();
+    if (not image) {
+      std::cout << "Could not take picture using camera pipeline" << std::endl;
+      return 1;
+    }
+    const double shot_ms = timer.ElapsedMs();
+    const std::string filename = NumberedFilename(outfile, i);
+    if (not image->WriteToBmp(filename)) {
+      std::cout << "Error writing image to " << filename << std::endl;
+      return 1;
+    }
+    std::cout << filename << " (exposure " << variants[i].exposure
+              << ", gamma " << variants[i].gamma << "): " << shot_ms << " ms"
+              << std::endl;
+  }
+  return 0;
+}
+
+// Takes @num_shots pictures, writing shot i to NumberedFilename(outfile, i),
+// and reports the sustained number of shots taken per second, not counting
+// shots rejected by backpressure. With @async the shots go through
+// AsyncCameraPipeline, and this thread only writes out finished images while
+// the next shots are being read out and processed.
+int TakePictures(CameraPipelineInterface* pipeline, const std::string& outfile,
+                 int num_shots, bool async,
+                 const AsyncCameraPipeline::Opts& async_opts) {
+  using ImagePtr = AsyncCameraPipeline::ImagePtr;
+  int failed = 0;
+  auto write = [&](ImagePtr image, int index) {
+    const std::string filename = NumberedFilename(outfile, index);
+    if (not image) {
+      // In async mode this is a shot rejected by backpressure.
+      std::cout << "Could not take picture " << index << std::endl;
+      if (not async) failed++;
+    } else if (not image->WriteToBmp(filename)) {
+      std::cout << "Error writing image to " << filename << std::endl;
+      failed++;
+    }
+  };
+
+  int rejected = 0;
+  Timer timer;
+  if (async) {
+    AsyncCameraPipeline camera(pipeline, async_opts);
+    std::deque<std::future<ImagePtr>> pending;
+    int written = 0;
+    for (int i = 0; i < num_shots; i++) {
+      pending.push_back(camera.TakePictureAsync());
+      // Keep at most one finished shot waiting to be written beyond the
+      // shots the pipeline has in flight.
+      while (static_cast<int>(pending.size()) > camera.queue_depth()) {
+        write(pending.front().get(), written++);
+        pending.pop_front();
+      }
+    }
+    while (not pending.empty()) {
+      write(pending.front().get(), written++);
+      pending.pop_front();
+    }
+    rejected = camera.rejected();
+  } else {
+    for (int i = 0; i < num_shots; i++) write(pipeline->TakePicture(), i);
+  }
+  const double seconds = timer.ElapsedMs() / 1000.;
+
+  const int taken = num_shots - rejected;
+  std::cout << taken << " shots (" << (async ? "async" : "blocking")
+            << ") in " << seconds << " s: " << taken / seconds << " shots/s";
+  if (rejected > 0) std::cout << ", " << rejected << " rejected";
+  std::cout << std::endl;
+  return failed > 0 ? 1 : 0;
+}
+
+// Takes @num_shots pictures of @scene on a RenderFarm of worker processes
+// running pipelines from @new_pipeline, writing shot i to
+// NumberedFilename(outfile, i), and reports the sustained shots per second.
+int RenderOnFarm(const SharedScene& scene,
+                 const RenderFarm::PipelineFactory& new_pipeline,
+                 const std::string& outfile, int num_shots,
+                 const RenderFarm::Opts& opts) {
+  Timer timer;
+  auto farm = RenderFarm::Start(scene, new_pipeline, opts);
+  if (not farm) {
+    std::cout << "Error starting " << opts.num_workers << " workers"
+              << std::endl;
+    return 1;
+  }
+  int failed = 0;
+  const bool finished = farm->Render(
+      num_shots, [&](int shot, std::unique_ptr<Image<Rgb8Pixel>> image) {
+    const std::string filename = NumberedFilename(outfile, shot);
+    if (not image) {
+      std::cout << "Could not take picture " << shot << std::endl;
+      failed++;
+    } else if (not image->WriteToBmp(filename)) {
+      std::cout << "Error writing image to " << filename << std::endl;
+      failed++;
+    }
+  });
+  farm.reset();
+  const double seconds = timer.ElapsedMs() / 1000.;
+  if (not finished) {
+    std::cout << "A worker exited before all shots were taken" << std::endl;
+    return 1;
+  }
+
+  std::cout << num_shots << " shots (" << opts.num_workers << " workers) in "
+            << seconds << " s: " << num_shots / seconds << " shots/s"
+            << std::endl;
+  return failed > 0 ? 1 : 0;
+}
+
+// Times the hierarchical alignment of burst frame 1 to frame 0 with each
+// AlignmentCost::Method, at search radius 4 and 8, and reports the speedup of
+// the box filtered search and how many tiles the methods disagree on.
+int BenchmarkAlignment(const CameraSensor* sensor) {
+  const int width = sensor->GetSensorWidth();
+  const int height = sensor->GetSensorHeight();
+  const BurstMerger::Opts opts;
+  CameraSensorData<CameraSensor::T> frame(width, height);
+  Pyramid reference(width, height, opts.num_levels);
+  Pyramid alternate(width, height, opts.num_levels);
+  sensor->ReadBurstFrame(0, 0, 0, frame.view());
+  reference.Build(frame.view());
+  sensor->ReadBurstFrame(1, 0, 0, frame.view());
+  alternate.Build(frame.view());
+
+  using Method = AlignmentCost::Method;
+  for (const int radius : {4, 8}) {
+    auto align = [&](Method method, bool subpixel, double* ms) {
+      // Best of 3 runs.
+      std::vector<TileAlignment> alignments;
+      *ms = std::numeric_limits<double>::max();
+      for (int run = 0; run < 3; run++) {
+        Timer timer;
+        alignments = AlignTiles(reference, alternate, opts.tile_size / 2,
+                                radius, method, subpixel);
+        *ms = std::min(*ms, timer.ElapsedMs());
+      }
+      return alignments;
+    };
+    double brute_ms, box_ms, subpixel_ms;
+    const auto brute = align(Method::kBruteForce, false, &brute_ms);
+    const auto box = align(Method::kBoxFiltered, false, &box_ms);
+    align(Method::kBoxFiltered, true, &subpixel_ms);
+    int differ = 0;
+    for (size_t i = 0; i < brute.size(); i++)
+      differ += brute[i].dy != box[i].dy || brute[i].dx != box[i].dx;
+    std::cout << "Radius " << radius << ": brute force " << brute_ms
+              << " ms, box filtered " << box_ms << " ms (" << brute_ms / box_ms
+              << "x), with sub-pixel refinement " << subpixel_ms << " ms; "
+              << differ << " of " << brute.size() << " tiles differ"
+              << std::endl;
+  }
+  return 0;
+}
+
+// Best time of 5 runs of @run, in ms.
+template<typename F>
+double BestOf5Ms(const F& run) {
+  double best_ms = std::numeric_limits<double>::max();
+  for (int i = 0; i < 5; i++) {
+    Timer timer;
+    run();
+    best_ms = std::min(best_ms, timer.ElapsedMs());
+  }
+  return best_ms;
+}
+
+// Compares the kernels specialized at compile time for the default tap count
+// and tile size with the generic kernels, for the pyramid downsample and the
+// windowed merge of a frame.
+int BenchmarkKernels(const CameraSensor* sensor) {
+  const int width = sensor->GetSensorWidth();
+  const int height = sensor->GetSensorHeight();
+  CameraSensorData<CameraSensor::T> frame(width, height);
+  sensor->ReadBurstFrame(0, 0, 0, frame.view());
+
+  Image<FloatPixel> gray(width / 2, height / 2);
+  BayerToGray(frame.view(), gray.view());
+  Image<FloatPixel> scratch(width / 4, height / 2);
+  Image<FloatPixel> specialized(width / 4, height / 4);
+  Image<FloatPixel> generic(width / 4, height / 4);
+  const double downsample_ms = BestOf5Ms([&] {
+    GaussianDownsample(gray.view(), scratch.view(), specialized.view());
+  });
+  const double generic_downsample_ms = BestOf5Ms([&] {
+    GaussianDownsampleGeneric(gray.view(), scratch.view(), generic.view(), 5);
+  });
+  const bool downsample_same = std::equal(
+      specialized.view().row(0), specialized.view().row(0) +
+      specialized.width() * specialized.height(), generic.view().row(0),
+      [](FloatPixel a, FloatPixel b) { return a.i == b.i; });
+  std::cout << "Downsample (5 taps): specialized " << downsample_ms
+            << " ms, generic " << generic_downsample_ms << " ms ("
+            << generic_downsample_ms / downsample_ms << "x)"
+            << (downsample_same ? "" : ", results differ") << std::endl;
+
+  BurstMerger::Opts opts;
+  BurstMerger merger(frame.Clone(), opts);
+  opts.specialized_kernels = false;
+  BurstMerger generic_merger(frame.Clone(), opts);
+  sensor->ReadBurstFrame(1, 0, 0, frame.view());
+  const std::vector<TileAlignment> alignments = merger.Align(frame.view());
+  const double merge_ms =
+      BestOf5Ms([&] { merger.MergeAligned(frame.view(), alignments); });
+  const double generic_merge_ms = BestOf5Ms(
+      [&] { generic_merger.MergeAligned(frame.view(), alignments); });
+  const auto merged = merger.Finish();
+  const auto generic_merged = generic_merger.Finish();
+  const bool merge_same = std::equal(
+      merged->view().row(0), merged->view().row(0) + width * height,
+      generic_merged->view().row(0));
+  std::cout << "Merge (" << opts.tile_size << "x" << opts.tile_size
+            << " tiles): specialized " << merge_ms << " ms, generic "
+            << generic_merge_ms << " ms (" << generic_merge_ms / merge_ms
+            << "x)" << (merge_same ? "" : ", results differ") << std::endl;
+  return 0;
+}
+
+// Runs VideoPipeline for @num_frames frames, writing them to @outfile.
+int RecordVideo(const CameraSensor* sensor, const std::string& outfile,
+                int num_frames, const ArgParser& parser) {
+  VideoPipeline::Opts opts;
+  if (parser.HasArg("--fps"))
+    opts.target_fps = std::atof(parser.GetArg("--fps").c_str());
+  VideoPipeline video(sensor, opts);
+
+  FILE* f = fopen(outfile.c_str(), "wb");
+  if (not f) {
+    std::cout << "Error opening " << outfile << std::endl;
+    return 1;
+  }
+  VideoPipeline::Stats stats;
+  const bool ok = video.Run(num_frames, f, &stats);
+  fclose(f);
+  if (not ok) {
+    std::cout << "Error writing video to " << outfile << std::endl;
+    return 1;
+  }
+
+  std::cout << "Wrote " << stats.frames << " frames of " << video.width()
+            << "x" << video.height() << " rgb24 to " << outfile << std::endl;
+  std::cout << "Target " << opts.target_fps << " fps, achieved "
+            << stats.frames / stats.seconds << " fps, " << stats.late_frames
+            << " late frames" << std::endl;
+  std::cout << "Sensor readout " << stats.readout_mean_ms
+            << " ms/frame (simulated, not included in latency)" << std::endl;
+  std::cout << "Latency ms: p50 " << stats.latency_p50_ms << ", p90 "
+            << stats.latency_p90_ms << ", p99 " << stats.latency_p99_ms
+            << ", max " << stats.latency_max_ms << std::endl;
+  return 0;
+}
+}  // namespace
 
 int main(int argc, char** argv) {
 
@@ -11,13 +313,44 @@ int main(int argc, char** argv) {
     std::cout << "usage: " << argv[0] << " scenefile outfile <options>" << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "   --nonoise    Disable sensor noise (for debugging)" << std::endl;
+    std::cout << "   --preview N  Fast preview using NxN binned readout (N = 2 or 4)" << std::endl;
+    std::cout << "   --burst N    Align and merge a burst of N frames (default: all captured frames)" << std::endl;
+    std::cout << "   --shots N    Take N pictures, writing outfile_0 ... outfile_N-1, and report shots/s" << std::endl;
+    std::cout << "                (not with --seed or --cache, which would repeat the same picture)" << std::endl;
+    std::cout << "   --async      Overlap readout, processing and writing of consecutive shots" << std::endl;
+    std::cout << "   --queue-depth N  Shots in flight in --async mode (default 3)" << std::endl;
+    std::cout << "   --reject     In --async mode, drop shots instead of waiting when the queue is full" << std::endl;
+    std::cout << "   --exposure E Linear gain applied by the output stage (default 1)" << std::endl;
+    std::cout << "   --gamma G    Output gamma, e.g. 0.4545 for display encoding (default 1)" << std::endl;
+    std::cout << "                Comma separated lists of E and G render every combination" << std::endl;
+    std::cout << "   --seed N     Seed sensor noise, so that re-renders capture the same noise" << std::endl;
+    std::cout << "   --cache DIR  Also keep cached stage outputs in DIR (created if needed), across runs (default seed 0)" << std::endl;
+    std::cout << "   --video N    Capture N frames of 1080p video to outfile as raw rgb24" << std::endl;
+    std::cout << "   --fps F      Target frame rate of --video (default 30)" << std::endl;
+    std::cout << "   --calibrate  Measure sensor defects from dark/flat frames and save them" << std::endl;
+    std::cout << "   --calib FILE Calibration file (default: scenefile with .calib extension)" << std::endl;
+    std::cout << "   --stats      Report current, peak and per-stage image memory" << std::endl;
+    std::cout << "   --mem-budget MB  Keep the image memory of a shot under MB megabytes" << std::endl;
+    std::cout << "   --farm N     Take --shots on N worker processes sharing one copy of the scene" << std::endl;
+    std::cout << "                (with a single --exposure and --gamma)" << std::endl;
+    std::cout << "   --align-bench  Compare brute force and box filtered burst alignment" << std::endl;
+    std::cout << "   --kernel-bench Compare specialized and generic downsample and merge kernels" << std::endl;
     return 1;
   }
   const std::string infile(argv[1]);
   const std::string outfile(argv[2]);
   ArgParser parser(argc - 3, argv + 3);
   
-  auto camera_sensor = CameraSensor::New(infile);
+  // A render farm's workers share the scene through shared memory; the
+  // coordinator uses the same copy.
+  std::shared_ptr<SharedScene> shared_scene;
+  std::unique_ptr<CameraSensor> camera_sensor;
+  if (parser.HasArg("--farm")) {
+    shared_scene = SharedScene::Create(infile);
+    if (shared_scene) camera_sensor = CameraSensor::New(shared_scene);
+  } else {
+    camera_sensor = CameraSensor::New(infile);
+  }
   if (not camera_sensor) {
     std::cout << "Error reading sensor data from " << infile << std::endl;
     return 0;
@@ -25,27 +358,217 @@ int main(int argc, char** argv) {
 
   if (parser.HasArg("--nonoise"))
       camera_sensor->SetNoiseMagnitude(0.f);
+
+  if (parser.HasArg("--align-bench"))
+    return BenchmarkAlignment(camera_sensor.get());
+  if (parser.HasArg("--kernel-bench"))
+    return BenchmarkKernels(camera_sensor.get());
+
+  const bool print_stats = parser.HasArg("--stats");
+  if (parser.HasArg("--video")) {
+    const int status = RecordVideo(
+        camera_sensor.get(), outfile,
+        std::atoi(parser.GetArg("--video").c_str()), parser);
+    if (print_stats) MemoryStats::Print(std::cout);
+    return status;
+  }
   
   camera_sensor->SetLensCap(false);
   
   // BEGIN: CS348K STUDENTS MODIFY THIS CODE 
   // You can modify the CameraPipeline class, including the constructor.
 
-  std::unique_ptr<CameraPipelineInterface> pipeline;
-  pipeline.reset(new CameraPipeline(camera_sensor.get()));
+  int preview_bin = 1;
+  if (parser.HasArg("--preview")) {
+    const std::string bin = parser.GetArg("--preview");
+    preview_bin = bin.empty() ? 4 : std::atoi(bin.c_str());
+    if (preview_bin != 2 && preview_bin != 4) {
+      std::cout << "Unsupported preview binning factor " << bin << std::endl;
+      return 1;
+    }
+  }
+
+  // Sensor defects are static per scene: measure them once with --calibrate
+  // and reuse the saved calibration for every later shot.
+  // The scene key hashes every raw plane of the scene, so it's only computed
+  // once a calibration file or the stage cache needs it.
+  std::string scene_key;
+  auto get_scene_key = [&scene_key, &infile]() -> const std::string& {
+    if (scene_key.empty()) scene_key = SensorCalibration::SceneKey(infile);
+    return scene_key;
+  };
+  std::string calib_file = parser.GetArg("--calib");
+  if (calib_file.empty()) calib_file = SensorCalibration::DefaultPath(infile);
+  std::unique_ptr<SensorCalibration> calibration;
+  if (parser.HasArg("--calibrate")) {
+    Timer timer;
+    calibration = SensorCalibration::Measure(
+        camera_sensor.get(), get_scene_key(), SensorCalibration::Opts());
+    if (not calibration->Save(calib_file)) {
+      std::cout << "Error writing calibration to " << calib_file << std::endl;
+      return 1;
+    }
+    std::cout << "Wrote calibration to " << calib_file << " in "
+              << timer.ElapsedMs() << " ms" << std::endl;
+  } else if (std::ifstream(calib_file)) {
+    calibration = SensorCalibration::Load(
+        calib_file, get_scene_key(), camera_sensor->GetSensorWidth(),
+        camera_sensor->GetSensorHeight());
+    if (calibration)
+      std::cout << "Using calibration " << calib_file << std::endl;
+  }
+
+  // Every combination of the output options, which all render the same shot.
+  std::vector<OutputStage::Opts> output_variants;
+  for (float exposure : ParseList(parser.GetArg("--exposure"), 1.f)) {
+    for (float gamma : ParseList(parser.GetArg("--gamma"), 1.f)) {
+      OutputStage::Opts output_opts;
+      output_opts.exposure = exposure;
+      output_opts.gamma = gamma;
+      output_variants.push_back(output_opts);
+    }
+  }
+  if (shared_scene && output_variants.size() > 1) {
+    std::cout << "--farm renders a single --exposure and --gamma" << std::endl;
+    return 1;
+  }
+
+  // Seeded noise repeats exactly, so every shot of a seeded series would be
+  // the same picture.
+  const int num_shots =
+      parser.HasArg("--shots") ? std::atoi(parser.GetArg("--shots").c_str()) : 1;
+  if (num_shots > 1 && (parser.HasArg("--seed") || parser.HasArg("--cache"))) {
+    std::cout << "--shots takes identical pictures with --seed or --cache"
+              << std::endl;
+    return 1;
+  }
+
+  // Re-rendering a shot with other output options reuses its merged readout
+  // from the stage cache. Cached readouts are only valid for the noise they
+  // were read with, so the cache requires seeded noise. A cache kept across
+  // runs defaults to seed 0, so that later runs can hit it; one that only
+  // lives for this run can use a random seed.
+  const bool use_cache = parser.HasArg("--cache") || output_variants.size() > 1;
+  std::unique_ptr<StageCache> stage_cache;
+  StageKey capture_key;
+  int64_t noise_seed = -1;
+  if (use_cache || parser.HasArg("--seed")) {
+    noise_seed = std::atoll(parser.GetArg("--seed").c_str());
+    if (not parser.HasArg("--seed") && not parser.HasArg("--cache")) {
+      noise_seed = std::random_device()() & 0x7fffffff;
+      std::cout << "Noise seed " << noise_seed << " (set with --seed)"
+                << std::endl;
+    }
+    camera_sensor->SetNoiseSeed(noise_seed);
+    capture_key.Add(get_scene_key()).Add(noise_seed)
+        .Add(parser.HasArg("--nonoise"));
+  }
+  if (use_cache) {
+    stage_cache = StageCache::Open(parser.GetArg("--cache"));
+    if (not stage_cache) {
+      std::cout << "Can't write to cache directory "
+                << parser.GetArg("--cache") << std::endl;
+      return 1;
+    }
+  }
+
+  // Builds the pipeline of the options above for @sensor. Render farm
+  // workers call this with their own sensors.
+  auto new_pipeline = [&](CameraSensor* sensor,
+                          std::unique_ptr<const SensorCalibration> calibration) {
+    std::unique_ptr<CameraPipeline> camera_pipeline(
+        new CameraPipeline(sensor, preview_bin));
+    camera_pipeline->SetCalibration(std::move(calibration));
+    if (parser.HasArg("--burst"))
+      camera_pipeline->SetBurstLength(std::atoi(parser.GetArg("--burst").c_str()));
+    camera_pipeline->SetOutputOpts(output_variants[0]);
+    if (parser.HasArg("--mem-budget")) {
+      const double megabytes = std::atof(parser.GetArg("--mem-budget").c_str());
+      camera_pipeline->SetMemoryBudget(
+          static_cast<size_t>(megabytes * 1024 * 1024));
+    }
+    if (stage_cache)
+      camera_pipeline->SetStageCache(stage_cache.get(), capture_key);
+    return camera_pipeline;
+  };
   
   // END: CS348K STUDENTS MODIFY THIS CODE 
   
+  if (shared_scene) {
+    std::cout << "Loaded scene into shared memory " << shared_scene->name()
+              << " (" << shared_scene->bytes() / (1024. * 1024.) << " MB)"
+              << std::endl;
+    RenderFarm::Opts farm_opts;
+    farm_opts.num_workers = std::max(1, std::atoi(parser.GetArg("--farm").c_str()));
+    // Each worker loads the calibration for its own pipeline, with the scene
+    // key the coordinator computed.
+    const int width = camera_sensor->GetSensorWidth();
+    const int height = camera_sensor->GetSensorHeight();
+    const bool calibrated = calibration != nullptr;
+    auto new_worker_pipeline = [&](CameraSensor* sensor)
+        -> std::unique_ptr<CameraPipelineInterface> {
+      if (parser.HasArg("--nonoise")) sensor->SetNoiseMagnitude(0.f);
+      sensor->SetNoiseSeed(noise_seed);
+      sensor->SetLensCap(false);
+      std::unique_ptr<SensorCalibration> worker_calibration;
+      if (calibrated) {
+        worker_calibration =
+            SensorCalibration::Load(calib_file, scene_key, width, height);
+      }
+      return new_pipeline(sensor, std::move(worker_calibration));
+    };
+    return RenderOnFarm(*shared_scene, new_worker_pipeline, outfile,
+                        std::max(1, num_shots), farm_opts);
+  }
+  // Only the workers of a farm need a pipeline.
+  std::unique_ptr<CameraPipeline> pipeline =
+      new_pipeline(camera_sensor.get(), std::move(calibration));
+  if (output_variants.size() > 1) {
+    const int status = RenderVariants(pipeline.get(), outfile, output_variants);
+    stage_cache->Print(std::cout);
+    if (print_stats) MemoryStats::Print(std::cout);
+    return status;
+  }
+  if (num_shots > 1 || parser.HasArg("--async")) {
+    AsyncCameraPipeline::Opts async_opts;
+    if (parser.HasArg("--queue-depth"))
+      async_opts.queue_depth = std::atoi(parser.GetArg("--queue-depth").c_str());
+    if (parser.HasArg("--reject"))
+      async_opts.backpressure = AsyncCameraPipeline::Backpressure::kReject;
+    const int status =
+        TakePictures(pipeline.get(), outfile, std::max(1, num_shots),
+                     parser.HasArg("--async"), async_opts);
+    if (print_stats) MemoryStats::Print(std::cout);
+    return status;
+  }
+
+  // The memory budget covers what the shot allocates, not the scene data.
+  const size_t scene_bytes = MemoryStats::current();
+  MemoryStats::ResetPeak();
+  Timer timer;
   auto image = pipeline->TakePicture();
   if (not image) {
     std::cout << "Could not take picture using camera pipeline" << std::endl;
     return 1;
   }
-  
+  const double shot_ms = timer.ElapsedMs();
+
+  timer.Reset();
   if (not image->WriteToBmp(outfile)) {
     std::cout << "Error writing image to " << outfile << std::endl;
     return 1;
   }
+  const double write_ms = timer.ElapsedMs();
+
+  std::cout << "TakePicture: " << shot_ms << " ms, WriteToBmp: " << write_ms
+            << " ms (" << image->width() << "x" << image->height()
+            << (preview_bin > 1 ? ", preview" : "") << ")" << std::endl;
+  if (stage_cache) stage_cache->Print(std::cout);
+  if (print_stats) {
+    MemoryStats::Print(std::cout);
+    std::cout << "Shot peak: " << (MemoryStats::peak() - scene_bytes) / (1024. * 1024.)
+              << " MB above the scene data" << std::endl;
+  }
   
   return 0;  
 }
@@ -6,71 +6,298 @@
 #endif
 
 #include "camera_pipeline.hpp"
+#include "common.hpp"
+#include "memory_stats.hpp"
 
-std::unique_ptr<Image<RgbPixel>> CameraPipeline::ProcessShot() const {
+int CameraPipeline::StripMargin() const {
+  // The hierarchical search reaches search_radius pixels at each level, i.e.
+  // 2^level * search_radius grayscale pixels of level 0, which are 2 raw rows.
+  const int reach = 2 * merge_opts_.search_radius *
+      ((1 << merge_opts_.num_levels) - 1) + merge_opts_.tile_size;
+  return (reach + kStripAlignment - 1) / kStripAlignment * kStripAlignment;
+}
+
+size_t CameraPipeline::EstimateShotBytes(int width, int height,
+                                         int strip_height) const {
+  const size_t frame = sizeof(T) * static_cast<size_t>(width) * height;
+  // The merged frame is alive while the output image is produced.
+  const size_t output =
+      frame + sizeof(Rgb8Pixel) * static_cast<size_t>(width) * height;
+  if (strip_height >= height) {
+    // The reference (which becomes the merged frame), one frame buffer and
+    // the merger.
+    return std::max(
+        output, 2 * frame + BurstMerger::Bytes(width, height, merge_opts_));
+  }
+  // The merged frame, and the reference, frame buffer and merger of a strip.
+  const int strip_rows = std::min(height, strip_height + 2 * StripMargin());
+  const size_t strip = sizeof(T) * static_cast<size_t>(width) * strip_rows;
+  return std::max(output, frame + 2 * strip +
+                  BurstMerger::Bytes(width, strip_rows, merge_opts_));
+}
+
+int CameraPipeline::StripHeight(int width, int height,
+                                size_t* estimate) const {
+  *estimate = EstimateShotBytes(width, height, height);
+  if (memory_budget_ == 0 || *estimate <= memory_budget_) return height;
+  // If no strip height meets the budget, the one that needs the least memory,
+  // which on small frames may be the whole frame.
+  int best_strip = height;
+  size_t best_estimate = *estimate;
+  const int margin = StripMargin();
+  for (int strip = height / 2 / kStripAlignment * kStripAlignment;
+       strip >= kStripAlignment; strip -= kStripAlignment) {
+    // A strip that reads the whole frame with its margins saves nothing.
+    if (strip + 2 * margin >= height) continue;
+    const size_t strip_estimate = EstimateShotBytes(width, height, strip);
+    if (strip_estimate <= memory_budget_) {
+      *estimate = strip_estimate;
+      return strip;
+    }
+    if (strip_estimate < best_estimate) {
+      best_strip = strip;
+      best_estimate = strip_estimate;
+    }
+  }
+  *estimate = best_estimate;
+  return best_strip;
+}
+
+BurstMerger::Opts CameraPipeline::MergeOpts() const {
+  BurstMerger::Opts opts = merge_opts_;
+  // Tiles stay a multiple of 4 pixels.
+  opts.tile_size = std::max(4, opts.tile_size / preview_bin_ / 4 * 4);
+  opts.search_radius = std::max(1, opts.search_radius / preview_bin_);
+  return opts;
+}
+
+std::unique_ptr<CameraSensorData<typename CameraPipeline::T>>
+CameraPipeline::ReadMergedPreview(int width, int height) const {
+  Timer timer;
+  const int num_frames =
+      burst_length_ > 0 ? burst_length_ : sensor_->GetBurstLength();
+  // Every binned frame is small, so the preview doesn't reuse frame buffers
+  // or merge in strips.
+  auto read_frame = [&](int i) {
+    MemoryStats::Stage stage("readout");
+    auto frame = sensor_->GetBinnedBurstFrame(i, 0, 0, width, height,
+                                              preview_bin_);
+    // Static defects were measured once for this scene, so fixing them up is
+    // a sparse pass over the known defects instead of a full frame search.
+    if (calibration_) calibration_->Apply(frame->view(), 0, 0, preview_bin_);
+    return frame;
+  };
+  auto reference = read_frame(0);
+  MemoryStats::Stage stage("merge");
+  BurstMerger merger(std::move(reference), MergeOpts());
+  for (int i = 1; i < num_frames; i++) merger.AddFrame(read_frame(i)->view());
+  auto merged = merger.Finish();
+  std::cout << "Merged " << num_frames << " binned frames in "
+            << timer.ElapsedMs() << " ms" << std::endl;
+  return merged;
+}
+
+std::unique_ptr<CameraSensorData<typename CameraPipeline::T>>
+CameraPipeline::MergeBurst(int top, int width, int height,
+                           int num_frames) const {
+  // The first frame becomes the merger's reference. Every later frame is
+  // read into the same buffer, which the merger is done with by the time
+  // the next frame is read. Defects are at sensor coordinates, so the
+  // calibration is offset by the strip's @top.
+  std::unique_ptr<CameraSensorData<T>> frame;
+  {
+    MemoryStats::Stage stage("readout");
+    frame.reset(new CameraSensorData<T>(width, height));
+    sensor_->ReadBurstFrame(0, 0, top, frame->view());
+    if (calibration_) calibration_->Apply(frame->view(), 0, top);
+  }
+  MemoryStats::Stage stage("merge");
+  BurstMerger merger(std::move(frame), merge_opts_);
+  if (num_frames > 1) {
+    MemoryStats::Stage stage("readout");
+    frame.reset(new CameraSensorData<T>(width, height));
+  }
+  for (int i = 1; i < num_frames; i++) {
+    sensor_->ReadBurstFrame(i, 0, top, frame->view());
+    if (calibration_) calibration_->Apply(frame->view(), 0, top);
+    merger.AddFrame(frame->view());
+  }
+  return merger.Finish();
+}
+
+std::unique_ptr<CameraSensorData<typename CameraPipeline::T>>
+CameraPipeline::ReadMergedBurst(int width, int height) const {
+  Timer timer;
+  const int num_frames =
+      burst_length_ > 0 ? burst_length_ : sensor_->GetBurstLength();
+
+  size_t estimate;
+  const int strip_height = StripHeight(width, height, &estimate);
+  if (memory_budget_ > 0) {
+    std::cout << "Memory budget " << memory_budget_ / (1024. * 1024.)
+              << " MB: estimated peak " << estimate / (1024. * 1024.) << " MB";
+    if (strip_height < height)
+      std::cout << ", merging in strips of " << strip_height << " rows";
+    std::cout << std::endl;
+    if (estimate > memory_budget_)
+      std::cout << "Memory budget can't be met, needs at least "
+                << estimate / (1024. * 1024.) << " MB" << std::endl;
+  }
+
+  std::unique_ptr<CameraSensorData<T>> merged;
+  if (strip_height >= height) {
+    merged = MergeBurst(0, width, height, num_frames);
+  } else {
+    {
+      MemoryStats::Stage stage("merge");
+      merged.reset(new CameraSensorData<T>(width, height));
+    }
+    const int margin = StripMargin();
+    for (int top = 0; top < height; top += strip_height) {
+      const int merge_top = std::max(0, top - margin);
+      const int merge_bottom = std::min(height, top + strip_height + margin);
+      const auto strip = MergeBurst(merge_top, width,
+                                    merge_bottom - merge_top, num_frames);
+      const int rows = std::min(strip_height, height - top);
+      for (int row = 0; row < rows; row++) {
+        const T* src = strip->view().row(top - merge_top + row);
+        std::copy(src, src + width, merged->view().row(top + row));
+      }
+    }
+  }
+
+  std::cout << "Merged " << num_frames << " frames in " << timer.ElapsedMs()
+            << " ms" << std::endl;
+  return merged;
+}
+
+std::unique_ptr<Image<Rgb8Pixel>> CameraPipeline::ProcessShot() const {
+  return ProcessReadout(ReadoutShot());
+}
+
+StageKey CameraPipeline::ReadoutKey() const {
+  const int width = sensor_->GetSensorWidth();
+  const int height = sensor_->GetSensorHeight();
+  // Bump kReadoutVersion whenever the readout, calibration, alignment or
+  // merge code changes its results, so that readouts cached on disk by
+  // older builds are no longer used.
+  constexpr int kReadoutVersion = 2;
+  StageKey key = StageKey::After(capture_key_);
+  key.Add(kReadoutVersion).Add(width).Add(height).Add(preview_bin_);
+  if (calibration_) {
+    key.Add(calibration_->defects().size());
+    for (const auto& defect : calibration_->defects()) key.Add(defect);
+    for (const auto& row_gain : calibration_->row_gains())
+      key.Add(row_gain.first).Add(row_gain.second);
+  }
+  const int num_frames =
+      burst_length_ > 0 ? burst_length_ : sensor_->GetBurstLength();
+  const BurstMerger::Opts merge_opts = MergeOpts();
+  key.Add(num_frames)
+      .Add(merge_opts.tile_size)
+      .Add(merge_opts.search_radius)
+      .Add(merge_opts.num_levels)
+      .Add(merge_opts.align_method)
+      .Add(merge_opts.subpixel)
+      .Add(merge_opts.min_distance)
+      .Add(merge_opts.max_distance);
+  if (preview_bin_ > 1) return key;
+  // Strips are merged slightly differently from the whole frame.
+  size_t estimate;
+  key.Add(StripHeight(width, height, &estimate));
+  return key;
+}
+
+std::unique_ptr<CameraSensorData<typename CameraPipeline::T>>
+CameraPipeline::ReadoutShot() const {
+  if (not stage_cache_) return ReadRawShot();
+  const StageKey key = ReadoutKey();
+  auto raw_data = stage_cache_->Get("readout", key);
+  if (raw_data) return raw_data;
+  raw_data = ReadRawShot();
+  if (raw_data) stage_cache_->Put("readout", key, *raw_data);
+  return raw_data;
+}
+
+std::unique_ptr<CameraSensorData<typename CameraPipeline::T>>
+CameraPipeline::ReadRawShot() const {
+  // put the lens cap on if you'd like to measure a "dark frame"
+  sensor_->SetLensCap(false);
+
+  // grab RAW pixel data from sensor
+  const int sensor_width = sensor_->GetSensorWidth();
+  const int sensor_height = sensor_->GetSensorHeight();
+
+  if (preview_bin_ > 1)
+    return ReadMergedPreview(sensor_width, sensor_height);
+  return ReadMergedBurst(sensor_width, sensor_height);
+}
+
+std::unique_ptr<Image<Rgb8Pixel>> CameraPipeline::ProcessReadout(
+    std::unique_ptr<CameraSensorData<T>> raw_data) const {
   // In this function you should implement your full RAW image processing pipeline.
   //   (1) Demosaicing
   //   (2) Address sensing defects such as bad pixels and image noise.
   //   (3) Apply local tone mapping based on the local laplacian filter or exposure fusion.
   //   (4) gamma correction
-    
+  // @raw_data is the output of ReadoutShot(). This function runs
+  // concurrently with the readout of the next shot, so it must not use the
+  // sensor.
+
   // The starter code copies the raw data from the sensor to all rgb
   // channels. This results in a gray image that is just a
   // visualization of the sensor's contents.
 
   // BEGIN: CS348K STUDENTS MODIFY THIS CODE
 
-  // put the lens cap on if you'd like to measure a "dark frame"
-  sensor_->SetLensCap(false);
-    
-  // grab RAW pixel data from sensor
-  const int width = sensor_->GetSensorWidth();
-  const int height = sensor_->GetSensorHeight();
-  auto raw_data = sensor_->GetSensorData(0, 0, width, height);
-  auto raw_data_vec = sensor_->GetBurstSensorData(0, 0, width, height);
+  MemoryStats::Stage stage("output");
+  const int width = raw_data->width();
+  const int height = raw_data->height();
 
 #ifdef __USE_HALIDE__
   std::cout << "Using Halide pipeline" << std::endl;
 
-  Halide::Buffer<float> input =
-    sensorDataToHalide(raw_data.get(), width, height);
+  Halide::Buffer<float> input = sensorViewToHalide(raw_data->view());
 
   // A stub camera pipeline that copies
   // the input to all output color channels
   Halide::Var x, y, c;
   Halide::Func cameraPipeline;
   cameraPipeline(x, y, c) =
-    input(x, y) * 255.0f;
-
-  Halide::Buffer<float> output =
-    cameraPipeline.realize(input.width(), input.height(), 3);
+    input(x, y);
 
-  std::unique_ptr<Image<RgbPixel>> image = rgbImageFromHalide(output);
+  // The output stage's lookup table applies exposure and gamma and quantizes
+  // to 8 bits inside the pipeline, and the result is realized straight into
+  // the output image.
+  Halide::Buffer<const uint8_t> lut(output_stage_.lut(),
+                                    output_stage_.lut_size());
+  Halide::Expr index = Halide::cast<int>(
+      cameraPipeline(x, y, c) * output_stage_.lut_scale() + .5f);
+  Halide::Func quantized;
+  quantized(x, y, c) =
+    lut(Halide::clamp(index, 0, output_stage_.lut_size() - 1));
+  // Channels of Rgb8Pixel are stored blue first.
+  Halide::Func output;
+  output(x, y, c) = quantized(x, y, 2 - c);
+  output.output_buffer().dim(0).set_stride(3).dim(2).set_stride(1);
+  output.reorder(c, x, y).bound(c, 0, 3).unroll(c);
 
+  std::unique_ptr<Image<Rgb8Pixel>> image(new Image<Rgb8Pixel>(width, height));
+  output.realize(rgb8ViewToHalide(image->view()));
   return image;
 
 #else
     
   std::cout << "Using vanilla C++ pipeline" << std::endl;
-  // allocate 3-channel RGB output buffer to hold the results after processing 
-  std::unique_ptr<Image<RgbPixel>> image(new Image<RgbPixel>(width, height));
-  
-  for (int row = 0; row < height; row++) {
-    for (int col = 0; col < width; col++) {
-      const auto val = raw_data->data(row, col);
-      auto& pixel = (*image)(row, col);
-
-      // pixel data from the sensor is normalized to the 0-1 range, so
-      // scale by 255 for the final image output.  Output image pixels
-      // should be in the 0-255 range.
-      pixel.r = val * 255.f;
-      pixel.g = val * 255.f;
-      pixel.b = val * 255.f;
-    }
-  }
-  
-  // return processed image output
-  return image;
+  // The output stage applies exposure and gamma and quantizes to 8 bits as
+  // it writes the output image. It calls this lambda for the linear RGB
+  // value of every pixel.
+  return output_stage_.Run(width, height, [&raw_data](int row, int col) {
+    // pixel data from the sensor is normalized to the 0-1 range, which
+    // the output stage maps to the 0-255 range of the final image.
+    const auto val = raw_data->data(row, col);
+    return RgbPixel(val, val, val);
+  });
 #endif
 
   // END: CS348K STUDENTS MODIFY THIS CODE  
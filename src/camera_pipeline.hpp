@@ -3,9 +3,13 @@
 #include <algorithm>
 #include <limits>
 #include <memory>
+#include "burst_merge.hpp"
 #include "camera_pipeline_interface.hpp"
 #include "image.hpp"
+#include "output_stage.hpp"
 #include "pixel.hpp"
+#include "sensor_calibration.hpp"
+#include "stage_cache.hpp"
 
 #ifdef __USE_HALIDE__
 #include "Halide.h"
@@ -16,18 +20,118 @@
 class CameraPipeline : public CameraPipelineInterface {
  public:
     
-  explicit CameraPipeline(CameraSensor* sensor)
-    : CameraPipelineInterface(sensor) {}
+  // @preview_bin > 1 selects the fast preview path: the burst is read out
+  // with @preview_bin x @preview_bin binning and the whole pipeline, burst
+  // merge included, runs at the reduced resolution.
+  explicit CameraPipeline(CameraSensor* sensor, int preview_bin = 1)
+    : CameraPipelineInterface(sensor), preview_bin_(std::max(1, preview_bin)) {}
+
+  // Static defect calibration of the sensor, applied to every readout in
+  // ProcessShot(). Without one, defects are left in the sensor data.
+  void SetCalibration(std::unique_ptr<const SensorCalibration> calibration) {
+    calibration_ = std::move(calibration);
+  }
+
+  // Number of burst frames to align and merge. Frames are streamed from the
+  // sensor and merged one at a time, so long bursts (replaying the captured
+  // frames with fresh noise) cost no extra memory. 0 uses
+  // CameraSensor::GetBurstLength().
+  void SetBurstLength(int num_frames) { burst_length_ = num_frames; }
+
+  // Exposure and gamma of the final 8-bit output.
+  void SetOutputOpts(const OutputStage::Opts& opts) {
+    output_stage_ = OutputStage(opts);
+  }
+
+  // Limits the image memory a shot may allocate to @bytes (0 for no limit).
+  // When merging the whole frame at once would exceed the budget, the burst
+  // is read out and merged in horizontal strips, each with enough margin for
+  // the alignment search, as tall as the budget allows. A budget below the
+  // smallest strip plus the merged frame and the output image can't be met;
+  // the smallest strips are used and a message is printed.
+  void SetMemoryBudget(size_t bytes) { memory_budget_ = bytes; }
+
+  // Caches the readout of every shot (the defect corrected, merged burst) in
+  // @cache, keyed by @capture and every parameter of the readout. @capture
+  // identifies what the sensor captures: the scene and the noise seed and
+  // magnitude of the sensor. Shots whose readout is cached, e.g. re-renders
+  // with different output options, only run ProcessReadout(). @cache must
+  // outlive the pipeline.
+  void SetStageCache(StageCache* cache, const StageKey& capture) {
+    stage_cache_ = cache;
+    capture_key_ = capture;
+  }
     
  private:
   using T = typename CameraSensor::T;
   using CameraPipelineInterface::sensor_;
 
-  std::unique_ptr<Image<RgbPixel>> ProcessShot() const override;
+  std::unique_ptr<Image<Rgb8Pixel>> ProcessShot() const override;
+  std::unique_ptr<CameraSensorData<T>> ReadoutShot() const override;
+  std::unique_ptr<Image<Rgb8Pixel>> ProcessReadout(
+      std::unique_ptr<CameraSensorData<T>> raw_data) const override;
 
   // BEGIN: CS348K STUDENTS MODIFY THIS CODE
   //
   // You can add any necessary private member variables or functions.
   //
+
+  // Binning factor of the preview path (1 for full resolution). Spatial
+  // parameters of the pipeline stages (merge tile size, search radius) are
+  // specified at full resolution and divided by this factor; see
+  // MergeOpts().
+  const int preview_bin_;
+
+  std::unique_ptr<const SensorCalibration> calibration_;
+  int burst_length_ = 0;
+  const BurstMerger::Opts merge_opts_{};
+  OutputStage output_stage_{OutputStage::Opts()};
+  size_t memory_budget_ = 0;
+  StageCache* stage_cache_ = nullptr;
+  StageKey capture_key_;
+
+  // ReadoutShot() without the stage cache.
+  std::unique_ptr<CameraSensorData<T>> ReadRawShot() const;
+
+  // Key of the output of ReadRawShot() in the stage cache.
+  StageKey ReadoutKey() const;
+
+  // Strip heights and margins of the strip merge are multiples of this many
+  // rows, so that strips have the tile grid and pyramid levels of the whole
+  // frame.
+  static constexpr int kStripAlignment = 64;
+
+  // Reads out the burst and aligns and merges it into a single Bayer frame,
+  // in strips if the memory budget requires it.
+  std::unique_ptr<CameraSensorData<T>> ReadMergedBurst(int width,
+                                                        int height) const;
+
+  // Preview version of ReadMergedBurst(): reads out the burst with
+  // @preview_bin_ binning and merges it with MergeOpts().
+  std::unique_ptr<CameraSensorData<T>> ReadMergedPreview(int width,
+                                                          int height) const;
+
+  // @merge_opts_, with tile size and search radius divided by @preview_bin_.
+  BurstMerger::Opts MergeOpts() const;
+
+  // Reads out and merges @num_frames frames of the @width x @height crop
+  // window at (0, @top).
+  std::unique_ptr<CameraSensorData<T>> MergeBurst(int top, int width,
+                                                   int height,
+                                                   int num_frames) const;
+
+  // Rows above and below a strip that are merged along with it, so that the
+  // alignment of the strip's tiles can search as far as in the whole frame.
+  int StripMargin() const;
+
+  // Estimated peak image memory of a full resolution shot of @width x
+  // @height merged in strips of @strip_height rows.
+  size_t EstimateShotBytes(int width, int height, int strip_height) const;
+
+  // Tallest strip (@height for the whole frame) whose estimated shot memory
+  // fits the budget, and that estimate in @estimate. If none fits, the strip
+  // height with the smallest estimate.
+  int StripHeight(int width, int height, size_t* estimate) const;
+
   // END: CS348K STUDENTS MODIFY THIS CODE  
 };
@@ -18,7 +18,8 @@ class CameraPipelineInterface {
   // color correction, etc.). This high-level process is common for all
   // implementations of CameraPipelineInterface. however, the exact processing
   // algorithms (ProcessShot()) are defined by the specific implementation.
-  std::unique_ptr<Image<RgbPixel>> TakePicture() {
+  // The result is the final 8-bit image, ready to be written out.
+  std::unique_ptr<Image<Rgb8Pixel>> TakePicture() {
     return ProcessShot();
   }
 
@@ -28,8 +29,28 @@ class CameraPipelineInterface {
  private:
   using T = typename CameraSensor::T;
 
+  // Runs ReadoutShot() and ProcessReadout() on separate threads.
+  friend class AsyncCameraPipeline;
+
   // Implementations need to implement these two functions:
   // Implementations of ProcessShot() should take the raw sensor data in
   // @raw_data and output a clean final image.
-  virtual std::unique_ptr<Image<RgbPixel>> ProcessShot() const = 0;
+  virtual std::unique_ptr<Image<Rgb8Pixel>> ProcessShot() const = 0;
+
+  // Optional split of ProcessShot() into two phases, so that the readout of
+  // one shot can overlap the processing of another (see
+  // AsyncCameraPipeline). ReadoutShot() does everything that needs the
+  // sensor and returns the data the rest of the pipeline starts from, e.g. a
+  // merged burst. ProcessReadout() turns that into the final image and must
+  // not use the sensor. The defaults do all the work in ProcessReadout():
+  // ReadoutShot() returns nullptr and ProcessReadout() ignores its readout
+  // and runs ProcessShot(), which reads the sensor itself. Implementations
+  // that override ReadoutShot() must override ProcessReadout() as well.
+  virtual std::unique_ptr<CameraSensorData<T>> ReadoutShot() const {
+    return nullptr;
+  }
+  virtual std::unique_ptr<Image<Rgb8Pixel>> ProcessReadout(
+      std::unique_ptr<CameraSensorData<T>> /* readout */) const {
+    return ProcessShot();
+  }
 };
@@ -1,5 +1,6 @@
 #include "camera_sensor.hpp"
 #include "common.hpp"
+#include "shared_scene.hpp"
 #include <algorithm>
 #include <cmath>
 #include <iostream>
@@ -8,86 +9,154 @@
 #include <cassert>
 
 namespace {
-template <typename T>
-void ReadBIN(const std::string& path, std::vector<CameraSensorImpl::SensorPlane> &planes,
-             std::vector<Image<RgbPixel> *> &perfect_images,
-             CameraSensorImpl::Opts& opts,
-             int &width, int &height,
-             T*& buffer) {
+// Intensity of the uniform target imaged by SetFlatField().
+constexpr float kFlatFieldValue = .5f;
+
+// Reads the planar float RGB image of @width x @height pixels at @offset of
+// scene file @path.
+std::unique_ptr<Image<RgbPixel>> ReadPerfectImage(const std::string& path,
+                                                  long offset, int width,
+                                                  int height) {
   FILE* f = fopen(path.c_str(), "rb");
-  assert(f);
-  int num_planes;
+  if (not f) return nullptr;
+  std::vector<float> perfect_image_buffer(width * height * 3);
+  fseek(f, offset, SEEK_SET);
+  const size_t read = fread(&(perfect_image_buffer[0]), sizeof(float),
+                            perfect_image_buffer.size(), f);
+  fclose(f);
+  if (read != perfect_image_buffer.size()) return nullptr;
+  const int channel_stride = width * height;
+  std::unique_ptr<Image<RgbPixel>> perfect_image(
+      new Image<RgbPixel>(width, height));
+  for (int row = 0; row < height; row++) {
+    for (int col = 0; col < width; col++) {
+      auto& pixel = (*perfect_image)(row, col);
+      const int pixel_index = width * row + col;
+      pixel.r = perfect_image_buffer[pixel_index];
+      pixel.g = perfect_image_buffer[pixel_index + channel_stride];
+      pixel.b = perfect_image_buffer[pixel_index + 2 * channel_stride];
+    }
+  }
+  return perfect_image;
+}
+}
+// static
+bool CameraSensorImpl::ReadScene(const std::string& filename,
+                                 const PlaneAllocator& allocate,
+                                 SceneInfo* info) {
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (not f) return false;
+  int num_planes = 0;
   fread(&num_planes, sizeof(num_planes), 1, f);
-  planes.resize(num_planes);
-  fread(&width, sizeof(width), 1, f);
-  fread(&height, sizeof(height), 1, f);
-  buffer = new T[num_planes * width * height];
-  T* plane_buffer = buffer;
+  fread(&info->width, sizeof(info->width), 1, f);
+  fread(&info->height, sizeof(info->height), 1, f);
+  const int width = info->width;
+  const int height = info->height;
+  T* plane_buffer = num_planes > 0 && width > 0 && height > 0
+      ? allocate(num_planes, width, height) : nullptr;
+  if (not plane_buffer) {
+    fclose(f);
+    return false;
+  }
+  info->planes.resize(num_planes);
   float focus;
-  std::vector<float> perfect_image_buffer(width * height * 3);
   for (int i = 0; i < num_planes; i++) {
-    planes[i].buffer = plane_buffer;
+    info->planes[i].buffer = plane_buffer;
     fread(&focus, sizeof(focus), 1, f);
     fread(plane_buffer, sizeof(T), width * height, f);
     plane_buffer += width * height;
-    fread(&(perfect_image_buffer[0]), sizeof(float), width * height * 3, f);
-    const int channel_stride = width * height;
-    std::unique_ptr<Image<RgbPixel>> perfect_image(
-        new Image<RgbPixel>(width, height));
-    for (int row = 0; row < height; row++) {
-      for (int col = 0; col < width; col++) {
-        auto& pixel = (*perfect_image)(row, col);
-        const int pixel_index = width * row + col;
-        pixel.r = perfect_image_buffer[pixel_index];
-        pixel.g = perfect_image_buffer[pixel_index + channel_stride];
-        pixel.b = perfect_image_buffer[pixel_index + 2 * channel_stride];
-      }
-    }
-    perfect_images.push_back(perfect_image.release());
+    // Perfect images are read on demand by GetPerfectImageView().
+    info->planes[i].perfect_image_offset = ftell(f);
+    fseek(f, sizeof(float) * width * height * 3, SEEK_CUR);
   }
-  fread(&opts, sizeof(opts), 1, f);
-  opts.noise_magnitude = .05f;
-}
+  fread(&info->opts, sizeof(info->opts), 1, f);
+  info->opts.noise_magnitude = .05f;
+  fclose(f);
+  return true;
 }
+
 // static
-std::unique_ptr<CameraSensor> CameraSensor::New(std::string filename) {
-  {
-    // Check if file exists
-    std::ifstream infile(filename);
-    if (!infile.good()) {
-      return nullptr;
+uint64_t CameraSensorImpl::HashScene(const std::string& filename) {
+  uint64_t hash = Fnv1a(nullptr, 0);
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (not f) return hash;
+  std::vector<char> chunk(1 << 20);
+  // Hashes the next @bytes bytes of the file.
+  auto hash_bytes = [&](size_t bytes) {
+    while (bytes > 0) {
+      const size_t read =
+          fread(chunk.data(), 1, std::min(bytes, chunk.size()), f);
+      if (read == 0) return;
+      hash = Fnv1a(chunk.data(), read, hash);
+      bytes -= read;
     }
+  };
+  int header[3] = {0, 0, 0};  // Number of planes, width and height.
+  fread(header, sizeof(int), 3, f);
+  hash = Fnv1a(header, sizeof(header), hash);
+  const size_t plane_size = static_cast<size_t>(std::max(0, header[1])) *
+      std::max(0, header[2]);
+  for (int i = 0; i < header[0]; i++) {
+    // The focus and the raw plane, then the perfect image.
+    hash_bytes(sizeof(float) + sizeof(T) * plane_size);
+    fseek(f, sizeof(float) * plane_size * 3, SEEK_CUR);
   }
+  hash_bytes(sizeof(Opts));
+  fclose(f);
+  return hash;
+}
 
-  std::vector<CameraSensorImpl::SensorPlane> planes;
-  std::vector<Image<RgbPixel>*> perfect_images;
-  int width;
-  int height;
-  CameraSensorImpl::Opts opts;
-  T* buffer;
-  ReadBIN<T>(filename, planes, perfect_images, opts, width, height, buffer);
+// static
+std::unique_ptr<CameraSensor> CameraSensor::New(std::string filename) {
+  MemoryStats::Stage stage("sensor");
+  std::shared_ptr<const T> buffer;
+  auto allocate = [&buffer](int num_planes, int width, int height) {
+    const size_t bytes = sizeof(T) * num_planes * width * height;
+    T* planes = new T[num_planes * width * height];
+    MemoryStats::Allocated(bytes);
+    buffer.reset(planes, [bytes](const T* planes) {
+      MemoryStats::Freed(bytes);
+      delete[] planes;
+    });
+    return planes;
+  };
+  CameraSensorImpl::SceneInfo info;
+  if (not CameraSensorImpl::ReadScene(filename, allocate, &info))
+    return nullptr;
   
   // Print some debugging information
   //std::cout << "Noise mag: " << opts.noise_magnitude << std::endl;
-  std::cout << "Read " << planes.size() << " sensor planes of size ("
-            << width << "," << height << ")" << std::endl;
+  std::cout << "Read " << info.planes.size() << " sensor planes of size ("
+            << info.width << "," << info.height << ")" << std::endl;
   
   return std::unique_ptr<CameraSensor>(
-      new CameraSensorImpl(
-          width, height, buffer, planes, perfect_images, opts));
+      new CameraSensorImpl(info.width, info.height, std::move(buffer),
+                           info.planes, filename, info.opts));
+}
+
+// static
+std::unique_ptr<CameraSensor> CameraSensor::New(
+    std::shared_ptr<const SharedScene> scene) {
+  const auto info = scene->info();
+  // The sensor's reference to its planes keeps the whole scene mapped.
+  std::shared_ptr<const T> buffer(scene, info.planes[0].buffer);
+  return std::unique_ptr<CameraSensor>(
+      new CameraSensorImpl(info.width, info.height, std::move(buffer),
+                           info.planes, scene->filename(), info.opts));
 }
 
 CameraSensorImpl::CameraSensorImpl(int width,
                                    int height,
-                                   const T* buffer,
+                                   std::shared_ptr<const T> buffer,
                                    std::vector<SensorPlane> planes,
-                                   std::vector<Image<RgbPixel>*> perfect_images,
+                                   std::string filename,
                                    Opts opts)
   : width_(width),
     height_(height),
-    buffer_(buffer),
+    buffer_(std::move(buffer)),
     planes_(planes),
-    perfect_images_(perfect_images),
+    filename_(std::move(filename)),
+    perfect_images_(planes_.size(), nullptr),
     opts_(opts) {
   Random random(0);  // deterministic seed
   // Instance dead pixels. About .1% of pixels will be dead.
@@ -97,52 +166,198 @@ CameraSensorImpl::CameraSensorImpl(int width,
     const int col = random.UniformRandom<int>(0, width - 1);
     dead_pixels_.insert({row, col});
   }
+  // Instance bright lines: about 1% of rows have a gain between
+  // row_gain_min and row_gain_max, if the scene sets any.
+  const int num_bright_lines = opts_.row_gain_max > 0.f ? height / 100 : 0;
+  while (bright_lines_.size() < num_bright_lines) {
+    const int row = random.UniformRandom<int>(0, height - 1);
+    bright_lines_[row] =
+        random.UniformRandom<T>(opts_.row_gain_min, opts_.row_gain_max);
+  }
+}
+
+float CameraSensorImpl::RowGain(int row) const {
+  const auto bright_line = bright_lines_.find(row);
+  return bright_line == bright_lines_.end() ? 1.f : bright_line->second;
 }
 
 std::unique_ptr<Image<RgbPixel>> CameraSensorImpl::GetPerfectImage(
     int left, int top, int width, int height) const {
+  const auto perfect_image = GetPerfectImageView(left, top, width, height);
+  if (perfect_image.width() == 0) return nullptr;
   std::unique_ptr<Image<RgbPixel>> image(new Image<RgbPixel>(width, height));
-  const auto& perfect_image = *(perfect_images_[active_sensor_plane_]);
   for (int row = 0; row < height; row++) {
-    for (int col = 0; col < width; col++) {
-      (*image)(row, col) = perfect_image(row + top, col + left);
-    }
+    std::copy(perfect_image.row(row), perfect_image.row(row) + width,
+              image->view().row(row));
   }
   return image;
 }
 
+ImageView<const RgbPixel> CameraSensorImpl::GetPerfectImageView(
+    int left, int top, int width, int height) const {
+  std::lock_guard<std::mutex> lock(perfect_images_mutex_);
+  Image<RgbPixel>*& perfect_image = perfect_images_[active_sensor_plane_];
+  if (not perfect_image) {
+    MemoryStats::Stage stage("sensor");
+    perfect_image = ReadPerfectImage(
+        filename_, planes_[active_sensor_plane_].perfect_image_offset,
+        width_, height_).release();
+    // A truncated scene file has no perfect image; return an empty view.
+    if (not perfect_image) return {nullptr, 0, 0};
+  }
+  return perfect_image->View(left, top, width, height);
+}
+
 std::unique_ptr<CameraSensorData<typename CameraSensorImpl::T>>
 CameraSensorImpl::GetSensorData(int left, int top, int width,
                                 int height) const {
-
-  Random noise;
-  noise.Reseed(); // noise is "truly" random, and unique per shot
-
   std::unique_ptr<CameraSensorData<T>> data(
       new CameraSensorData<T>(width, height));
+  ReadPlane(active_sensor_plane_, active_sensor_plane_, left, top,
+            data->view());
+  return data;
+}
 
-  const auto &plane = planes_[active_sensor_plane_];
-  const T *const buff = plane.buffer;
+void CameraSensorImpl::ReadBurstFrame(int frame, int left, int top,
+                                      SensorView<T> data,
+                                      Random* noise) const {
+  ReadPlane(frame % planes_.size(), frame, left, top, data, noise);
+}
+
+void CameraSensorImpl::SeedNoise(std::initializer_list<int> readout,
+                                 Random* noise) const {
+  if (noise_seed_ < 0) {
+    noise->Reseed(); // noise is "truly" random, and unique per shot
+    return;
+  }
+  uint64_t hash = Fnv1a(&noise_seed_, sizeof(noise_seed_));
+  for (const int value : readout) hash = Fnv1a(&value, sizeof(value), hash);
+  noise->Seed(static_cast<Random::ResultType>(hash ^ (hash >> 32)));
+}
+
+void CameraSensorImpl::ReadPlane(int plane_index, int frame, int left, int top,
+                                 SensorView<T> data, Random* noise_in) const {
+  Random own_noise;
+  Random& noise = noise_in ? *noise_in : own_noise;
+  // A caller's generator is already random; seeded noise is reseeded for
+  // every readout either way.
+  if (not noise_in || noise_seed_ >= 0)
+    SeedNoise({frame, left, top, data.width(), data.height(), 1}, &noise);
+
+  const int width = data.width();
+  const int height = data.height();
+  const auto &plane = planes_[plane_index];
+  const auto source = SensorView<const T>(plane.buffer, width_, height_)
+      .Crop(left, top, width, height);
 
   for (int row = 0; row < height; row++) {
+    const T gain = RowGain(top + row);
     for (int col = 0; col < width; col++) {
-      const std::array<int, 2> index = {row, col};
-      if (In(dead_pixels_, index)) {
-        data->data(row, col) = opts_.dead_pixel_value;
-        continue;
-      }
+      T value;
       if (lens_cap_) {
-        data->data(row, col) = 0.f;
+        value = 0.f;
+      } else if (flat_field_) {
+        value = kFlatFieldValue * gain;
       } else {
-        data->data(row, col) = buff[(top + row) * width_ + (left + col)];
+        value = source(row, col) * gain;
       }
       
       // Add uniform random noise scales by noise_magnitude
-      T value = data->data(row, col) + opts_.noise_magnitude * noise.UniformRandom<T>(-0.5f, 0.5f);
+      value += opts_.noise_magnitude * noise.UniformRandom<T>(-0.5f, 0.5f);
       // clamp to (0,1) range
+      data(row, col) = std::max(0.0f, std::min(1.f, value));
+    }
+  }
+
+  // Dead pixels are sparse, so overwrite them afterwards rather than looking
+  // up every pixel in the defect set. They are at fixed sensor positions,
+  // so a crop window only shows the ones inside of it.
+  for (const auto& dead_pixel : dead_pixels_) {
+    const int row = dead_pixel[0] - top;
+    const int col = dead_pixel[1] - left;
+    if (row < 0 || col < 0 || row >= height || col >= width) continue;
+    data(row, col) = opts_.dead_pixel_value;
+  }
+}
+
+std::unique_ptr<CameraSensorData<typename CameraSensorImpl::T>>
+CameraSensorImpl::GetBinnedSensorData(int left, int top, int width, int height,
+                                      int bin) const {
+  if (bin <= 1) return GetSensorData(left, top, width, height);
+  return ReadBinnedPlane(active_sensor_plane_, active_sensor_plane_, left, top,
+                         width, height, bin);
+}
+
+std::unique_ptr<CameraSensorData<typename CameraSensorImpl::T>>
+CameraSensorImpl::GetBinnedBurstFrame(int frame, int left, int top, int width,
+                                      int height, int bin) const {
+  if (bin <= 1) {
+    std::unique_ptr<CameraSensorData<T>> data(
+        new CameraSensorData<T>(width, height));
+    ReadBurstFrame(frame, left, top, data->view());
+    return data;
+  }
+  return ReadBinnedPlane(frame % planes_.size(), frame, left, top, width,
+                         height, bin);
+}
+
+std::unique_ptr<CameraSensorData<typename CameraSensorImpl::T>>
+CameraSensorImpl::ReadBinnedPlane(int plane_index, int frame, int left,
+                                  int top, int width, int height,
+                                  int bin) const {
+  Random noise;
+  SeedNoise({frame, left, top, width, height, bin}, &noise);
+
+  // Each 2x2 Bayer quad of the output covers a (2 * bin) x (2 * bin) block of
+  // the crop window. Partial blocks at the right and bottom edges are dropped.
+  const int block = 2 * bin;
+  const int out_width = (width / block) * 2;
+  const int out_height = (height / block) * 2;
+  std::unique_ptr<CameraSensorData<T>> data(
+      new CameraSensorData<T>(out_width, out_height));
+
+  const auto &plane = planes_[plane_index];
+  const T *const buff = plane.buffer;
+  const T scale = 1.f / (bin * bin);
+
+  std::vector<T> gains(bin);  // of the sensor rows of an output row.
+  for (int row = 0; row < out_height; row++) {
+    // Top-left photosite of this output pixel's color in the source block.
+    const int src_row = top + (row / 2) * block + (row % 2);
+    for (int i = 0; i < bin; i++) gains[i] = RowGain(src_row + 2 * i);
+    for (int col = 0; col < out_width; col++) {
+      const int src_col = left + (col / 2) * block + (col % 2);
+      T sum = 0.f;
+      if (not lens_cap_) {
+        for (int i = 0; i < bin; i++) {
+          const T gain = gains[i];
+          if (flat_field_) {
+            sum += kFlatFieldValue * bin * gain;
+            continue;
+          }
+          const T* src = buff + (src_row + 2 * i) * width_ + src_col;
+          T row_sum = 0.f;
+          for (int j = 0; j < bin; j++) row_sum += src[2 * j];
+          sum += row_sum * gain;
+        }
+      }
+      // Charge is summed on the sensor, so read noise is added only once.
+      T value = sum * scale + opts_.noise_magnitude * noise.UniformRandom<T>(-0.5f, 0.5f);
       data->data(row, col) = std::max(0.0f, std::min(1.f, value));
     }
   }
+
+  // Dead pixels are sparse, so rather than testing every photosite, mark the
+  // binned pixel each one falls into.
+  for (const auto& dead_pixel : dead_pixels_) {
+    const int row = dead_pixel[0] - top;
+    const int col = dead_pixel[1] - left;
+    if (row < 0 || col < 0) continue;
+    const int out_row = (row / block) * 2 + (row % 2);
+    const int out_col = (col / block) * 2 + (col % 2);
+    if (out_row >= out_height || out_col >= out_width) continue;
+    data->data(out_row, out_col) = opts_.dead_pixel_value;
+  }
   return data;
 }
 
@@ -158,3 +373,15 @@ CameraSensorImpl::GetBurstSensorData(
   active_sensor_plane_ = temp_index;
   return data;
 }
+
+void CameraSensor::StreamBurstSensorData(
+    int left, int top, int width, int height, int num_frames,
+    const BurstFrameCallback& callback) const {
+  if (num_frames <= 0) num_frames = GetBurstLength();
+  for (int frame = 0; frame < num_frames; ++frame) {
+    std::unique_ptr<CameraSensorData<T>> data(
+        new CameraSensorData<T>(width, height));
+    ReadBurstFrame(frame, left, top, data->view());
+    callback(frame, std::move(data));
+  }
+}
@@ -1,22 +1,56 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <string>
 #include <cstring>
 #include <vector>
+#include "common.hpp"
 #include "image.hpp"
+#include "memory_stats.hpp"
 #include "pixel.hpp"
+#include "view.hpp"
 
 // Simple container class for sensor data output by camera. Basically a
 // container for a statically sized 2D array.
 template<typename T> class CameraSensorData {
  public:
   CameraSensorData(int width, int height)
-      : width_(width), height_(height), data_(new T[width_ * height_]) {}
+      : width_(width), height_(height), data_(new T[width_ * height_]) {
+    MemoryStats::Allocated(sizeof(T) * width_ * height_);
+  }
+
+  ~CameraSensorData() {
+    if (data_) MemoryStats::Freed(sizeof(T) * width_ * height_);
+    delete[] data_;  // data_ is always new'ed.
+  }
 
-  ~CameraSensorData() { delete[] data_; }  // data_ is always new'ed.
+  // Sensor data can be moved, leaving @that empty (0x0).
+  CameraSensorData(CameraSensorData&& that)
+      : width_(that.width_), height_(that.height_), data_(that.data_) {
+    that.width_ = 0;
+    that.height_ = 0;
+    that.data_ = nullptr;
+  }
+  CameraSensorData& operator=(CameraSensorData&& that) {
+    if (this != &that) {
+      if (data_) MemoryStats::Freed(sizeof(T) * width_ * height_);
+      delete[] data_;
+      width_ = that.width_;
+      height_ = that.height_;
+      data_ = that.data_;
+      that.width_ = 0;
+      that.height_ = 0;
+      that.data_ = nullptr;
+    }
+    return *this;
+  }
 
   // Returns the width (in pixels) of the sensor output data. This may not be
   // the same as the width of the original sensor, if the user requested a crop
@@ -35,6 +69,17 @@ template<typename T> class CameraSensorData {
   const T& data(int row, int col) const { return data_[row * width_ + col]; }
   T& data(int row, int col) { return data_[row * width_ + col]; }
 
+  // Views of all of the data, or of the crop window at @left, @top. Views
+  // refer to this data without copying it.
+  SensorView<T> view() { return {data_, width_, height_}; }
+  SensorView<const T> view() const { return {data_, width_, height_}; }
+  SensorView<T> View(int left, int top, int width, int height) {
+    return view().Crop(left, top, width, height);
+  }
+  SensorView<const T> View(int left, int top, int width, int height) const {
+    return view().Crop(left, top, width, height);
+  }
+
   // A method to create a new copy of this sensor data.
   std::unique_ptr<CameraSensorData> Clone() const {
     std::unique_ptr<CameraSensorData> clone(
@@ -48,11 +93,13 @@ template<typename T> class CameraSensorData {
   CameraSensorData(CameraSensorData&);
   void operator=(const CameraSensorData&);
 
-  const int width_;
-  const int height_;
-  T* const data_;
+  int width_;
+  int height_;
+  T* data_;
 };
 
+class SharedScene;
+
 // CameraSensor interface
 class CameraSensor {
  public:
@@ -62,6 +109,12 @@ class CameraSensor {
   // reading binary data from file @filename.
   static std::unique_ptr<CameraSensor> New(std::string filename);
 
+  // Creates a new CameraSensor reading its raw planes straight from @scene,
+  // without copying them. Sensors of any number of processes can share one
+  // scene this way.
+  static std::unique_ptr<CameraSensor> New(
+      std::shared_ptr<const SharedScene> scene);
+
   virtual ~CameraSensor() {}
 
   // Returns width (in pixels) of images that this sensor captures.
@@ -76,16 +129,39 @@ class CameraSensor {
   // artifacts.
   virtual void SetLensCap(bool lens_cap) = 0;
 
+  // Points the virtual camera at a uniform, evenly lit calibration target.
+  // While set (and the lens cap is off), all calls to GetSensorData() return
+  // a "flat frame" of a 50% gray field. Flat frames still have noise and
+  // sensor defect artifacts.
+  virtual void SetFlatField(bool flat_field) = 0;
+
   // Set the magnitude of random noise added to all sensor output buffers
   virtual void SetNoiseMagnitude(float max) = 0;
 
+  // Makes the noise of every readout a function of @seed and of what is read
+  // (burst frame, crop window and binning), so that repeating a readout with
+  // the same seed repeats its noise exactly. A negative @seed (the default)
+  // makes noise random and unique per readout.
+  virtual void SetNoiseSeed(int64_t seed) = 0;
+
   // Returns an RGB image corresponding to a "perfectly" processed version of
   // the output of the sensor.  @width, and @height specify a crop window of
   // pixels to access, and the size of the resulting CameraSensorData structure
   // is the size of this crop window (not necessarily the size of the sensor).
+  // Perfect images are read from the scene file on first use (see
+  // GetPerfectImageView()), so this returns nullptr if the file can no
+  // longer be read or has no perfect image for the current plane.
   virtual std::unique_ptr<Image<RgbPixel>> GetPerfectImage(
       int left, int top, int width, int height) const = 0;
 
+  // Same as GetPerfectImage(), but returns a view of the sensor's own copy of
+  // the perfect image instead of copying the crop window. The view is valid
+  // for the lifetime of the sensor. Perfect images are three times the size
+  // of the raw data, so they are only loaded on first use. Returns an empty
+  // (0x0) view if the scene file can't be read at that point.
+  virtual ImageView<const RgbPixel> GetPerfectImageView(
+      int left, int top, int width, int height) const = 0;
+
   // Returns a 2D array corresponding to the raw output of the sensor. @left, @top,
   // @width, and @height specify a crop window of pixels to access, and the size
   // of the resulting CameraSensorData structure is the size of this crop window
@@ -93,12 +169,59 @@ class CameraSensor {
   virtual std::unique_ptr<CameraSensorData<T>> GetSensorData(
       int left, int top, int width, int height) const = 0;
 
+  // Returns a reduced resolution readout of the crop window @left, @top,
+  // @width, @height, where every @bin x @bin group of same-color pixels is
+  // averaged on the sensor before readout. The result is still a Bayer mosaic
+  // with the same pattern as GetSensorData(), of size
+  // (width / (2 * bin)) * 2 by (height / (2 * bin)) * 2. A @bin of 1 is
+  // equivalent to GetSensorData().
+  virtual std::unique_ptr<CameraSensorData<T>> GetBinnedSensorData(
+      int left, int top, int width, int height, int bin) const = 0;
+
+  // Binned readout, as in GetBinnedSensorData(), of frame @frame of a burst
+  // (replayed as in ReadBurstFrame()).
+  virtual std::unique_ptr<CameraSensorData<T>> GetBinnedBurstFrame(
+      int frame, int left, int top, int width, int height, int bin) const = 0;
+
   // Returns a vector of 2D arrays corresponding to a burst of readouts from
   // the raw sensor output. @left, @top, @width, and @height specify a crop window
   // of pixels to access, and the size of the resulting CameraSensorData structure
   // is the size of this crop window (not necessarily the size of the sensor). 
   virtual std::vector<std::unique_ptr<CameraSensorData<T>>> GetBurstSensorData(
       int left, int top, int width, int height) const = 0;
+
+  // Returns the number of distinct frames captured for a burst, i.e. the
+  // number of frames returned by GetBurstSensorData().
+  virtual int GetBurstLength() const = 0;
+
+  // Called by StreamBurstSensorData() with the index of each frame in the
+  // burst and its sensor data, in capture order.
+  using BurstFrameCallback =
+      std::function<void(int frame, std::unique_ptr<CameraSensorData<T>> data)>;
+
+  // Convenience wrapper over ReadBurstFrame() for consumers that want each
+  // frame in its own buffer: reads out frames 0 ... @num_frames - 1 one at a
+  // time and hands each one to @callback as soon as it is read.
+  // @num_frames <= 0 reads GetBurstLength() frames. Every frame is a new
+  // allocation; to stream a burst through a reused buffer, as
+  // CameraPipeline does, call ReadBurstFrame() directly.
+  void StreamBurstSensorData(int left, int top, int width, int height,
+                             int num_frames,
+                             const BurstFrameCallback& callback) const;
+
+  // Reads frame @frame of a burst into @data, which is preallocated by the
+  // caller and whose size is the crop window at @left, @top. Bursts longer
+  // than GetBurstLength() replay the captured frames in order, with fresh
+  // noise. This is how bursts are streamed: a burst merge or continuous
+  // capture (e.g. video) can cycle through a few CameraSensorData buffers
+  // without allocating, and @data may also be a window of a larger buffer.
+  // If given, @noise generates the noise of the readout: unseeded noise (see
+  // SetNoiseSeed()) then continues from the state of @noise instead of
+  // drawing a fresh seed from the system, which is too slow for every frame
+  // of a video.
+  virtual void ReadBurstFrame(int frame, int left, int top,
+                              SensorView<T> data,
+                              Random* noise = nullptr) const = 0;
 };
 
 // An implementation of the CameraSensor interface which provides sensor data
@@ -107,7 +230,8 @@ class CameraSensorImpl : public CameraSensor {
  public:
   using T = typename CameraSensor::T;
   struct SensorPlane {
-    T* buffer;  // does not own.
+    const T* buffer;  // does not own.
+    long perfect_image_offset = 0;  // in the scene file.
   };
   struct Opts {
     T dead_pixel_value = 10000.f;
@@ -116,37 +240,96 @@ class CameraSensorImpl : public CameraSensor {
     T noise_magnitude = 0.f;
   };
 
+  // Everything in a scene file but its pixels.
+  struct SceneInfo {
+    int width = 0;
+    int height = 0;
+    std::vector<SensorPlane> planes;
+    Opts opts;
+  };
+
+  // Returns storage for the raw planes of a scene, one after the other.
+  using PlaneAllocator =
+      std::function<T*(int num_planes, int width, int height)>;
+
+  // Reads the raw planes of scene file @filename into storage from
+  // @allocate, and describes the scene in @info, whose planes point into that
+  // storage. Perfect images are left in the file. Returns false if the file
+  // can't be read or @allocate returns nullptr.
+  static bool ReadScene(const std::string& filename,
+                        const PlaneAllocator& allocate, SceneInfo* info);
+
+  // Fnv1a() hash of what ReadScene() reads from scene file @filename: its
+  // header, raw planes and sensor options. The perfect images, most of the
+  // file, are skipped. Returns the hash of nothing if the file can't be read.
+  static uint64_t HashScene(const std::string& filename);
+
+  // @buffer holds the raw planes; the sensor keeps a reference to it.
   CameraSensorImpl(int width,
                    int height,
-                   const T* buffer,
+                   std::shared_ptr<const T> buffer,
                    std::vector<SensorPlane> planes,
-                   std::vector<Image<RgbPixel>*> perfect_images,
+                   std::string filename,
                    Opts opts);
   ~CameraSensorImpl() {
-    delete[] buffer_;
     for (auto& image : perfect_images_) delete image;
     std::vector<Image<RgbPixel>*>().swap(perfect_images_);
   }
   int GetSensorWidth() const override { return width_; }
   int GetSensorHeight() const override { return height_; }
   void SetLensCap(bool lens_cap) override { lens_cap_ = lens_cap; }
+  void SetFlatField(bool flat_field) override { flat_field_ = flat_field; }
   void SetNoiseMagnitude(float mag) override { opts_.noise_magnitude = mag; }
+  void SetNoiseSeed(int64_t seed) override { noise_seed_ = seed; }
   std::unique_ptr<Image<RgbPixel>> GetPerfectImage(
       int left, int top, int width, int height) const override;
+  ImageView<const RgbPixel> GetPerfectImageView(
+      int left, int top, int width, int height) const override;
   std::unique_ptr<CameraSensorData<T>> GetSensorData(
       int left, int top, int width, int height) const override;
+  std::unique_ptr<CameraSensorData<T>> GetBinnedSensorData(
+      int left, int top, int width, int height, int bin) const override;
+  std::unique_ptr<CameraSensorData<T>> GetBinnedBurstFrame(
+      int frame, int left, int top, int width, int height,
+      int bin) const override;
   std::vector<std::unique_ptr<CameraSensorData<T>>> GetBurstSensorData(
       int left, int top, int width, int height) const override;
+  int GetBurstLength() const override { return planes_.size(); }
+  void ReadBurstFrame(int frame, int left, int top, SensorView<T> data,
+                      Random* noise = nullptr) const override;
 
  private:
+  // Reads sensor plane @plane_index into @data, with noise and defects.
+  // @frame identifies the readout for SetNoiseSeed(). @noise is as in
+  // ReadBurstFrame().
+  void ReadPlane(int plane_index, int frame, int left, int top,
+                 SensorView<T> data, Random* noise = nullptr) const;
+
+  // Binned readout of sensor plane @plane_index, as in GetBinnedSensorData().
+  // @frame identifies the readout for SetNoiseSeed().
+  std::unique_ptr<CameraSensorData<T>> ReadBinnedPlane(
+      int plane_index, int frame, int left, int top, int width, int height,
+      int bin) const;
+
+  // Gain of sensor row @row: 1, or that of the bright line at @row.
+  float RowGain(int row) const;
+
+  // Seeds @noise for the readout described by @readout (see SetNoiseSeed()).
+  void SeedNoise(std::initializer_list<int> readout, Random* noise) const;
+
   const int width_;
   const int height_;
-  const T* const buffer_;  // owns.
+  const std::shared_ptr<const T> buffer_;
   const std::vector<SensorPlane> planes_;
-  std::vector<Image<RgbPixel>*> perfect_images_;  // owns pointers.
+  const std::string filename_;  // scene file, for loading perfect images.
+  mutable std::mutex perfect_images_mutex_;
+  // Owns pointers. Entries are null until the image is first used.
+  mutable std::vector<Image<RgbPixel>*> perfect_images_;
   Opts opts_;
   bool lens_cap_ = false;
+  bool flat_field_ = false;
+  int64_t noise_seed_ = -1;
   mutable int active_sensor_plane_ = 0;  // start with first plane by default.
-  std::map<int, float> bright_lines_;
+  std::map<int, float> bright_lines_;  // row -> gain.
   std::set<std::array<int, 2>> dead_pixels_;
 };
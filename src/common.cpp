@@ -1,4 +1,123 @@
 #include "common.hpp"
+#include <unistd.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+// Whether this thread is running a task of a pool.
+thread_local bool in_task = false;
+
+// Workers of RunOnThreadPool(). The pool hands out one batch of tasks at a
+// time: workers wake up for every new batch and take tasks until none are
+// left, and the caller takes tasks too.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int num_workers) : pid_(getpid()) {
+    for (int i = 0; i < num_workers; i++)
+      workers_.emplace_back(&ThreadPool::Work, this);
+  }
+
+  // Stops and joins the workers. Nobody may be running a batch.
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) worker.join();
+  }
+
+  pid_t pid() const { return pid_; }
+  int num_workers() const { return workers_.size(); }
+
+  // Runs a batch, or returns false if another batch is running.
+  bool TryRun(int num_tasks, const std::function<void(int)>& task) {
+    std::unique_lock<std::mutex> batch_lock(batch_mutex_, std::try_to_lock);
+    if (not batch_lock.owns_lock()) return false;
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_ = &task;
+    num_tasks_ = num_tasks;
+    next_task_ = 0;
+    done_tasks_ = 0;
+    batch_++;
+    wake_.notify_all();
+    RunTasks(&lock);
+    finished_.wait(lock, [this] { return done_tasks_ == num_tasks_; });
+    task_ = nullptr;
+    return true;
+  }
+
+ private:
+  // Takes tasks of the current batch until none are left. Called with
+  // @lock held, which is released while a task runs.
+  void RunTasks(std::unique_lock<std::mutex>* lock) {
+    while (next_task_ < num_tasks_) {
+      const int i = next_task_++;
+      const std::function<void(int)>& task = *task_;
+      lock->unlock();
+      in_task = true;
+      task(i);
+      in_task = false;
+      lock->lock();
+      if (++done_tasks_ == num_tasks_) finished_.notify_all();
+    }
+  }
+
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    uint64_t batch = 0;
+    for (;;) {
+      wake_.wait(lock, [&] { return stop_ || batch_ != batch; });
+      if (stop_) return;
+      batch = batch_;
+      RunTasks(&lock);
+    }
+  }
+
+  const pid_t pid_;
+  std::vector<std::thread> workers_;
+  std::mutex batch_mutex_;  // held by the caller running a batch.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable finished_;
+  // Guarded by @mutex_.
+  const std::function<void(int)>* task_ = nullptr;
+  int num_tasks_ = 0;
+  int next_task_ = 0;
+  int done_tasks_ = 0;
+  uint64_t batch_ = 0;
+  bool stop_ = false;
+};
+
+std::mutex pool_mutex;
+// Replaced when ParallelForThreads() changes; callers running a batch keep
+// the old pool alive until they are done.
+std::shared_ptr<ThreadPool> pool;
+}  // namespace
+
+void RunOnThreadPool(int num_tasks, const std::function<void(int)>& task) {
+  if (in_task) {
+    for (int i = 0; i < num_tasks; i++) task(i);
+    return;
+  }
+  std::shared_ptr<ThreadPool> current;
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    const int num_workers = std::max(1, ParallelForThreads()) - 1;
+    if (pool && pool->pid() != getpid()) {
+      // A forked child has none of its parent's threads, so the parent's
+      // pool can't be joined. It is leaked instead.
+      new std::shared_ptr<ThreadPool>(std::move(pool));
+    }
+    if (not pool || pool->num_workers() != num_workers)
+      pool = std::make_shared<ThreadPool>(num_workers);
+    current = pool;
+  }
+  if (current->TryRun(num_tasks, task)) return;
+  for (int i = 0; i < num_tasks; i++) task(i);
+}
 
 template<> int Random::UniformRandom<int>(const int& a, const int& b) {
   return std::uniform_int_distribution<>(a, b)(generator_);
@@ -12,3 +131,4 @@ template<> double Random::UniformRandom<double>(
     const double& a, const double& b) {
   return std::uniform_real_distribution<double>(a, b)(generator_);
 }
+
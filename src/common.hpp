@@ -1,9 +1,13 @@
 #pragma once
 
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <map>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 template<typename T>
@@ -33,6 +37,71 @@ class Random {
   GeneratorType generator_;
 };
 
+// 64-bit FNV-1a hash of the @size bytes at @data, continuing from @hash.
+inline uint64_t Fnv1a(const void* data, size_t size,
+                      uint64_t hash = 14695981039346656037ull) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// Wall clock stopwatch, started on construction.
+class Timer {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  Timer() : start_(Clock::now()) {}
+
+  void Reset() { start_ = Clock::now(); }
+
+  // Milliseconds elapsed since construction or the last Reset().
+  double ElapsedMs() const {
+    return std::chrono::duration<double, std::milli>(
+        Clock::now() - start_).count();
+  }
+
+ private:
+  Clock::time_point start_;
+};
+
+// Number of threads ParallelFor() uses, the number of hardware threads by
+// default. Processes that share the machine, like render farm workers, lower
+// it to their share of the hardware threads.
+inline int& ParallelForThreads() {
+  static int num_threads = std::max(1u, std::thread::hardware_concurrency());
+  return num_threads;
+}
+
+// Runs @task(i) for every i in [0, @num_tasks) and returns once all of them
+// are done. Tasks run on the calling thread and on a pool of
+// ParallelForThreads() - 1 worker threads. The pool is started on first
+// use and kept until ParallelForThreads() changes, so parallel loops on hot
+// paths (every output image, every video frame) don't start threads. Calls made
+// while the pool is busy, e.g. from another pipeline thread or from inside
+// a task, run their tasks on the calling thread.
+void RunOnThreadPool(int num_tasks, const std::function<void(int)>& task);
+
+// Calls @f(begin_i, end_i) on contiguous chunks covering [@begin, @end), one
+// chunk per thread (see ParallelForThreads()), and returns once all of them
+// are done. Chunks run on the calling thread when only one thread is
+// available.
+template<typename F>
+void ParallelFor(int begin, int end, const F& f) {
+  const int num_threads = std::max(1, ParallelForThreads());
+  const int count = end - begin;
+  const int num_chunks = std::max(1, std::min(num_threads, count));
+  if (num_chunks == 1) {
+    if (count > 0) f(begin, end);
+    return;
+  }
+  RunOnThreadPool(num_chunks, [&](int i) {
+    f(begin + count * i / num_chunks, begin + count * (i + 1) / num_chunks);
+  });
+}
+
 template<typename K, typename V>
 V GetOrDefault(const std::map<K, V>& map, const K& key, const V& val) {
   if (map.find(key) == map.end()) return val;
@@ -40,25 +40,22 @@ sensorDataToHalide(CameraSensorData<float>* raw_data,
   return input;
 }
 
-std::unique_ptr<Image<RgbPixel>> rgbImageFromHalide(Halide::Buffer<float>& output) {
-  std::unique_ptr<Image<RgbPixel>> image(new Image<RgbPixel>(output.width(), output.height()));
-
-  for (int row = 0; row < output.height(); row++) {
-    for (int col = 0; col < output.width(); col++) {
-
-      // Note: Halide uses the col, row, channel convention
-      float r = output(col, row, 0);
-      float g = output(col, row, 1);
-      float b = output(col, row, 2);
-
-      auto& pixel = (*image)(row, col);
-      pixel.r = r;
-      pixel.g = g;
-      pixel.b = b;
-    }
-  }
+Halide::Buffer<float>
+sensorViewToHalide(SensorView<float> raw_data) {
+  // Halide dimensions are {min, extent, stride}, innermost (x) first.
+  halide_dimension_t shape[2] = {
+    {0, raw_data.width(), 1},
+    {0, raw_data.height(), raw_data.row_stride()}};
+  return Halide::Buffer<float>(raw_data.row(0), 2, shape);
+}
 
-  return image;
+Halide::Buffer<uint8_t>
+rgb8ViewToHalide(ImageView<Rgb8Pixel> image) {
+  halide_dimension_t shape[3] = {
+    {0, image.width(), 3},
+    {0, image.height(), 3 * image.row_stride()},
+    {0, 3, 1}};
+  return Halide::Buffer<uint8_t>(&image.row(0)->b, 3, shape);
 }
 
 #endif
@@ -18,6 +18,16 @@ sensorDataToHalide(CameraSensorData<float>* raw_data,
     const int width,
     const int height);
 
-std::unique_ptr<Image<RgbPixel>> rgbImageFromHalide(Halide::Buffer<float>& output);
+// Wraps @raw_data in a Halide buffer without copying it. The buffer refers to
+// the memory behind the view and must not outlive it.
+Halide::Buffer<float>
+sensorViewToHalide(SensorView<float> raw_data);
+
+// Wraps the pixels of @image in a (x, y, c) Halide buffer without copying
+// them, so that a Func can be realized straight into the image. Rgb8Pixel
+// stores blue, green, red, so channel c = 0 is blue and c = 2 is red. The
+// buffer must not outlive the memory behind the view.
+Halide::Buffer<uint8_t>
+rgb8ViewToHalide(ImageView<Rgb8Pixel> image);
 
 #endif
@@ -1,14 +1,47 @@
 #include "image.hpp"
 #include <stdio.h>
 #include <stdlib.h>
+#include <cmath>
 #include <cstring>
 #include <vector>
 #include "common.hpp"
+#include "memory_stats.hpp"
 #include "pixel.hpp"
 
 template<typename Pixel>
 Image<Pixel>::Image(int width, int height)
-    : width_(width), height_(height), pixels_(new Pixel[width_ * height_]) {}
+    : width_(width), height_(height), pixels_(new Pixel[width_ * height_]) {
+  MemoryStats::Allocated(sizeof(Pixel) * width_ * height_);
+}
+
+template<typename Pixel>
+Image<Pixel>::~Image() {
+  if (pixels_) MemoryStats::Freed(sizeof(Pixel) * width_ * height_);
+  delete[] pixels_;
+}
+
+template<typename Pixel>
+Image<Pixel>::Image(Image&& that)
+    : width_(that.width_), height_(that.height_), pixels_(that.pixels_) {
+  that.width_ = 0;
+  that.height_ = 0;
+  that.pixels_ = nullptr;
+}
+
+template<typename Pixel>
+Image<Pixel>& Image<Pixel>::operator=(Image&& that) {
+  if (this != &that) {
+    if (pixels_) MemoryStats::Freed(sizeof(Pixel) * width_ * height_);
+    delete[] pixels_;
+    width_ = that.width_;
+    height_ = that.height_;
+    pixels_ = that.pixels_;
+    that.width_ = 0;
+    that.height_ = 0;
+    that.pixels_ = nullptr;
+  }
+  return *this;
+}
 
 template<typename Pixel>
 void Image<Pixel>::GammaCorrect(float gamma) {
@@ -26,57 +59,78 @@ std::unique_ptr<Image<Pixel>> Image<Pixel>::Clone() const {
   return image;
 }
 
-template<>
-bool Image<RgbPixel>::WriteToBmp(std::string filename) const {
-  auto clamp = [] (RgbPixel::T v) {
-    return static_cast<unsigned char>(Clamp(v, 0.f, 255.f));
-  };
-  const int filesize = 54 + 3 * width_ * height_;
-  std::vector<unsigned char> buff(3 * width_ * height_);
-  for (int j = 0; j < height_; j++) {
-    const auto* scan_line = pixels_ + j * width_;
-    for (int i = 0; i < width_; i++) {
-      const int x = i;
-      const int y = (height_ - 1) - j;
-      buff[(x + y * width_) * 3 + 2] = clamp(scan_line[i].r);
-      buff[(x + y * width_) * 3 + 1] = clamp(scan_line[i].g);
-      buff[(x + y * width_) * 3 + 0] = clamp(scan_line[i].b);
-    }
-  }
+namespace {
+// Writes a 24-bit BMP file of @width x @height pixels. @pack_row(row, dst)
+// writes the 3 * @width blue, green, red bytes of image row @row to @dst. The
+// file is assembled in memory, with rows packed in parallel, and written out
+// with a single fwrite.
+template<typename PackRow>
+bool WriteBmp(const std::string& filename, int width, int height,
+              const PackRow& pack_row) {
+  const int row_size = (3 * width + 3) & ~3;  // rows are padded to 4 bytes.
+  const int filesize = 54 + row_size * height;
+  std::vector<unsigned char> file(filesize);
 
-  unsigned char file_header[14] =
+  unsigned char* file_header = &file[0];
+  unsigned char* info_header = &file[14];
+  const unsigned char file_header_init[14] =
       {'B', 'M', 0, 0, 0, 0, 0, 0, 0, 0, 54, 0, 0, 0};
-  unsigned char info_header[40] =
+  const unsigned char info_header_init[16] =
       {40, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 24, 0};
-  unsigned char pad[3] = { 0, 0, 0 };
+  std::memcpy(file_header, file_header_init, sizeof(file_header_init));
+  std::memcpy(info_header, info_header_init, sizeof(info_header_init));
 
   file_header[2] = (unsigned char)(filesize);
   file_header[3] = (unsigned char)(filesize >> 8);
   file_header[4] = (unsigned char)(filesize >> 16);
   file_header[5] = (unsigned char)(filesize >> 24);
 
-  info_header[4] = (unsigned char)(width_);
-  info_header[5] = (unsigned char)(width_ >> 8);
-  info_header[6] = (unsigned char)(width_ >> 16);
-  info_header[7] = (unsigned char)(width_ >> 24);
-  info_header[8] = (unsigned char)(height_);
-  info_header[9] = (unsigned char)(height_ >> 8);
-  info_header[10] = (unsigned char)(height_ >> 16);
-  info_header[11] = (unsigned char)(height_ >> 24);
+  info_header[4] = (unsigned char)(width);
+  info_header[5] = (unsigned char)(width >> 8);
+  info_header[6] = (unsigned char)(width >> 16);
+  info_header[7] = (unsigned char)(width >> 24);
+  info_header[8] = (unsigned char)(height);
+  info_header[9] = (unsigned char)(height >> 8);
+  info_header[10] = (unsigned char)(height >> 16);
+  info_header[11] = (unsigned char)(height >> 24);
+
+  // BMP rows are stored bottom-up.
+  ParallelFor(0, height, [&](int begin, int end) {
+    for (int row = begin; row < end; row++)
+      pack_row(row, &file[54 + (height - 1 - row) * row_size]);
+  });
 
   FILE* f = fopen(filename.c_str(), "wb");
   if (not f) return false;
-  fwrite(file_header, sizeof(unsigned char), 14, f);
-  fwrite(info_header, sizeof(unsigned char), 40, f);
-  for (int i = 0; i < height_; i++) {
-    fwrite(&(buff[0]) + (width_ * i * 3),
-           3 * sizeof(unsigned char),
-           width_,
-           f);
-    fwrite(pad, sizeof(unsigned char), (4 - (width_ * 3) % 4) % 4, f);
-  }
-  fclose(f);
-  return true;
+  const bool written = fwrite(file.data(), 1, filesize, f) == filesize;
+  return fclose(f) == 0 && written;
+}
+}  // namespace
+
+template<>
+bool Image<RgbPixel>::WriteToBmp(std::string filename) const {
+  auto clamp = [] (RgbPixel::T v) {
+    return static_cast<unsigned char>(Clamp(v, 0.f, 255.f));
+  };
+  return WriteBmp(filename, width_, height_,
+                  [this, &clamp](int row, unsigned char* dst) {
+    const auto* scan_line = pixels_ + row * width_;
+    for (int i = 0; i < width_; i++) {
+      dst[3 * i + 2] = clamp(scan_line[i].r);
+      dst[3 * i + 1] = clamp(scan_line[i].g);
+      dst[3 * i + 0] = clamp(scan_line[i].b);
+    }
+  });
+}
+
+template<>
+bool Image<Rgb8Pixel>::WriteToBmp(std::string filename) const {
+  // Rgb8Pixel is laid out like a BMP pixel, so rows are copied as they are.
+  static_assert(sizeof(Rgb8Pixel) == 3, "Rgb8Pixel must be packed");
+  return WriteBmp(filename, width_, height_,
+                  [this](int row, unsigned char* dst) {
+    std::memcpy(dst, pixels_ + row * width_, 3 * width_);
+  });
 }
 
 // static
@@ -107,6 +161,39 @@ std::unique_ptr<Image<RgbPixel>> Image<RgbPixel>::ReadFromBmp(
   return image;
 }
 
+// static
+template<>
+std::unique_ptr<Image<Rgb8Pixel>> Image<Rgb8Pixel>::ReadFromBmp(
+    std::string filename) {
+  auto rgb_image = Image<RgbPixel>::ReadFromBmp(filename);
+  if (not rgb_image) return nullptr;
+  std::unique_ptr<Image> image(
+      new Image(rgb_image->width(), rgb_image->height()));
+  for (int row = 0; row < image->height(); row++) {
+    for (int col = 0; col < image->width(); col++) {
+      const auto& pixel = (*rgb_image)(row, col);
+      (*image)(row, col) = Rgb8Pixel(pixel.r, pixel.g, pixel.b);
+    }
+  }
+  return image;
+}
+
+// 8-bit images are gamma corrected through a lookup table over the 256
+// possible values, treating 255 as 1.
+template<>
+void Image<Rgb8Pixel>::GammaCorrect(float gamma) {
+  unsigned char lut[256];
+  for (int i = 0; i < 256; i++) {
+    lut[i] = static_cast<unsigned char>(
+        Clamp(255.f * std::pow(i / 255.f, gamma) + .5f, 0.f, 255.f));
+  }
+  for (int i = 0; i < width_ * height_; i++) {
+    pixels_[i].r = lut[pixels_[i].r];
+    pixels_[i].g = lut[pixels_[i].g];
+    pixels_[i].b = lut[pixels_[i].b];
+  }
+}
+
 // Read/Write of images not supported for float images.
 template<>
 bool Image<FloatPixel>::WriteToBmp(std::string) const {
@@ -120,3 +207,4 @@ std::unique_ptr<Image<FloatPixel>> Image<FloatPixel>::ReadFromBmp(std::string) {
 
 template class Image<RgbPixel>;
 template class Image<FloatPixel>;
+template class Image<Rgb8Pixel>;
@@ -2,13 +2,18 @@
 
 #include <memory>
 #include <string>
+#include "view.hpp"
 
 template<typename Pixel> class Image {
  public:
   using PixelType = Pixel;
 
   Image(int width, int height);
-  ~Image() { delete[] pixels_; }  // pixels_ is always new'ed.
+  ~Image();
+
+  // Images can be moved, leaving @that empty (0x0).
+  Image(Image&& that);
+  Image& operator=(Image&& that);
 
   int width() const { return width_; }
   int height() const { return height_; }
@@ -20,6 +25,18 @@ template<typename Pixel> class Image {
     return pixels_[row * width_ + col];
   }
 
+  // Views of all of the image, or of the crop window at @left, @top. Views
+  // refer to the pixels of this image without copying them.
+  ImageView<Pixel> view() { return {pixels_, width_, height_}; }
+  ImageView<const Pixel> view() const { return {pixels_, width_, height_}; }
+  ImageView<Pixel> View(int left, int top, int width, int height) {
+    return view().Crop(left, top, width, height);
+  }
+  ImageView<const Pixel> View(int left, int top, int width,
+                              int height) const {
+    return view().Crop(left, top, width, height);
+  }
+
   void GammaCorrect(float gamma);
 
   std::unique_ptr<Image> Clone() const;
@@ -32,7 +49,7 @@ template<typename Pixel> class Image {
   Image(Image&);
   void operator=(const Image&);
 
-  const int width_;
-  const int height_;
-  Pixel* const pixels_;
+  int width_;
+  int height_;
+  Pixel* pixels_;
 };
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+// Filter taps and windows of the hot kernels of the pipeline, generated at
+// compile time. Kernels templated on a tap count or tile size take their
+// tables from here, so that their loops have constant bounds and
+// coefficients the compiler can unroll and vectorize.
+// Every table also has a runtime version for sizes that aren't specialized,
+// computed by the same code, so that both give bit identical results.
+namespace kernel_tables {
+
+constexpr double kPi = 3.14159265358979323846;
+
+// Cosine of @x, to double precision. (std::cos is not constexpr.)
+constexpr double Cos(double x) {
+  // Reduce to [-pi, pi], then sum the Taylor series.
+  const double turns = x / (2 * kPi);
+  const long long whole = static_cast<long long>(turns < 0 ? turns - .5
+                                                           : turns + .5);
+  x -= 2 * kPi * whole;
+  double term = 1.;
+  double sum = 1.;
+  for (int k = 1; k < 30; k++) {
+    term *= -x * x / ((2 * k - 1) * (2 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+// Tap @k of the @num_taps-tap binomial filter, which approximates a Gaussian
+// and sums to 1.
+constexpr float BinomialTap(int k, int num_taps) {
+  double coefficient = 1.;
+  for (int i = 0; i < k; i++)
+    coefficient = coefficient * (num_taps - 1 - i) / (i + 1);
+  for (int i = 0; i < num_taps - 1; i++) coefficient /= 2.;
+  return static_cast<float>(coefficient);
+}
+
+template<int kNumTaps>
+constexpr std::array<float, kNumTaps> BinomialTaps() {
+  std::array<float, kNumTaps> taps{};
+  for (int k = 0; k < kNumTaps; k++) taps[k] = BinomialTap(k, kNumTaps);
+  return taps;
+}
+
+inline std::vector<float> BinomialTaps(int num_taps) {
+  std::vector<float> taps(num_taps);
+  for (int k = 0; k < num_taps; k++) taps[k] = BinomialTap(k, num_taps);
+  return taps;
+}
+
+// Entry @i of the raised cosine window of @size entries. Windows of tiles
+// overlapping by half sum to 1.
+constexpr float RaisedCosine(int i, int size) {
+  return static_cast<float>(.5 - .5 * Cos(2. * kPi * (i + .5) / size));
+}
+
+template<int kSize>
+constexpr std::array<float, kSize> RaisedCosineWindow() {
+  std::array<float, kSize> window{};
+  for (int i = 0; i < kSize; i++) window[i] = RaisedCosine(i, kSize);
+  return window;
+}
+
+inline std::vector<float> RaisedCosineWindow(int size) {
+  std::vector<float> window(size);
+  for (int i = 0; i < size; i++) window[i] = RaisedCosine(i, size);
+  return window;
+}
+
+}  // namespace kernel_tables
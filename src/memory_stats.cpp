@@ -0,0 +1,93 @@
+#include "memory_stats.hpp"
+#include <algorithm>
+#include <iomanip>
+
+namespace {
+constexpr const char* kNoStage = "(other)";
+
+thread_local const char* current_stage = kNoStage;
+
+std::mutex& Mutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+// Guarded by Mutex().
+size_t current_bytes = 0;
+size_t peak_bytes = 0;
+std::map<std::string, MemoryStats::StageStats>& StageMap() {
+  static std::map<std::string, MemoryStats::StageStats> stages;
+  return stages;
+}
+
+double Megabytes(size_t bytes) { return bytes / (1024. * 1024.); }
+}  // namespace
+
+MemoryStats::Stage::Stage(const char* name) : parent_(current_stage) {
+  current_stage = name;
+  std::lock_guard<std::mutex> lock(Mutex());
+  auto& stage = StageMap()[name];
+  stage.peak = std::max(stage.peak, current_bytes);
+}
+
+MemoryStats::Stage::~Stage() { current_stage = parent_; }
+
+// static
+void MemoryStats::Allocated(size_t bytes) {
+  std::lock_guard<std::mutex> lock(Mutex());
+  current_bytes += bytes;
+  peak_bytes = std::max(peak_bytes, current_bytes);
+  auto& stage = StageMap()[current_stage];
+  stage.allocated += bytes;
+  stage.peak = std::max(stage.peak, current_bytes);
+}
+
+// static
+void MemoryStats::Freed(size_t bytes) {
+  std::lock_guard<std::mutex> lock(Mutex());
+  current_bytes -= std::min(bytes, current_bytes);
+}
+
+// static
+size_t MemoryStats::current() {
+  std::lock_guard<std::mutex> lock(Mutex());
+  return current_bytes;
+}
+
+// static
+size_t MemoryStats::peak() {
+  std::lock_guard<std::mutex> lock(Mutex());
+  return peak_bytes;
+}
+
+// static
+void MemoryStats::ResetPeak() {
+  std::lock_guard<std::mutex> lock(Mutex());
+  peak_bytes = current_bytes;
+}
+
+// static
+std::map<std::string, MemoryStats::StageStats> MemoryStats::stages() {
+  std::lock_guard<std::mutex> lock(Mutex());
+  return StageMap();
+}
+
+// static
+void MemoryStats::Print(std::ostream& out) {
+  const auto stage_stats = stages();
+  const auto flags = out.flags();
+  const auto precision = out.precision();
+  out << std::fixed << std::setprecision(1);
+  out << "Image memory: current " << Megabytes(current()) << " MB, peak "
+      << Megabytes(peak()) << " MB" << std::endl;
+  out << "  " << std::left << std::setw(16) << "stage" << std::right
+      << std::setw(14) << "allocated MB" << std::setw(14) << "peak MB"
+      << std::endl;
+  for (const auto& stage : stage_stats) {
+    out << "  " << std::left << std::setw(16) << stage.first << std::right
+        << std::setw(14) << Megabytes(stage.second.allocated)
+        << std::setw(14) << Megabytes(stage.second.peak) << std::endl;
+  }
+  out.flags(flags);
+  out.precision(precision);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+// Process-wide accounting of the pixel storage of Image, CameraSensorData and
+// the sensor's scene data: bytes currently allocated, their high-water mark,
+// and a breakdown by pipeline stage. Code marks the stage it is running with
+// a MemoryStats::Stage object; allocations made on that thread while it is
+// alive are attributed to the stage.
+class MemoryStats {
+ public:
+  struct StageStats {
+    size_t allocated = 0;  // total bytes allocated while in the stage.
+    size_t peak = 0;       // highest current() seen while in the stage.
+  };
+
+  // Marks the calling thread as running stage @name (a string literal) until
+  // destroyed. Stages nest; the innermost one is charged.
+  class Stage {
+   public:
+    explicit Stage(const char* name);
+    ~Stage();
+
+   private:
+    Stage(Stage&);
+    void operator=(const Stage&);
+
+    const char* const parent_;
+  };
+
+  static void Allocated(size_t bytes);
+  static void Freed(size_t bytes);
+
+  static size_t current();
+  static size_t peak();
+  // Restarts the high-water mark at current(), e.g. to measure one shot.
+  static void ResetPeak();
+  static std::map<std::string, StageStats> stages();
+
+  // Prints current and peak usage and the per-stage breakdown.
+  static void Print(std::ostream& out);
+};
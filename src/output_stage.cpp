@@ -0,0 +1,21 @@
+#include "output_stage.hpp"
+#include <algorithm>
+#include <cmath>
+
+OutputStage::OutputStage(const Opts& opts) : opts_(opts), lut_(kLutSize) {
+  // The table covers the linear range that isn't clipped by the exposure.
+  const float exposure = std::max(opts_.exposure, 1e-6f);
+  const float max_linear = std::max(1.f, 1.f / exposure);
+  lut_scale_ = (kLutSize - 1) / max_linear;
+  for (int i = 0; i < kLutSize; i++) {
+    const float value = std::min(1.f, exposure * i / lut_scale_);
+    lut_[i] = static_cast<unsigned char>(
+        Clamp(255.f * std::pow(value, opts_.gamma) + .5f, 0.f, 255.f));
+  }
+}
+
+std::unique_ptr<Image<Rgb8Pixel>> OutputStage::Run(
+    ImageView<const RgbPixel> linear) const {
+  return Run(linear.width(), linear.height(),
+             [&linear](int row, int col) { return linear(row, col); });
+}
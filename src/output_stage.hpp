@@ -0,0 +1,70 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "common.hpp"
+#include "image.hpp"
+#include "pixel.hpp"
+
+// Final stage of the pipeline. Applies exposure and gamma to linear RGB and
+// quantizes the result to 8 bits, all through a single lookup table. The
+// output is written straight into an Image<Rgb8Pixel>, so a float RGB image
+// of the whole frame is never stored.
+class OutputStage {
+ public:
+  struct Opts {
+    // Linear gain applied before the tone curve.
+    float exposure = 1.f;
+    // Output = 255 * min(1, exposure * linear) ^ gamma. A gamma of 1 / 2.2
+    // approximates an sRGB display encoding; 1 keeps the output linear.
+    float gamma = 1.f;
+  };
+
+  explicit OutputStage(const Opts& opts);
+
+  const Opts& opts() const { return opts_; }
+
+  // 8-bit output value of linear intensity @value, nominally in [0, 1].
+  unsigned char operator()(float value) const {
+    const int index = static_cast<int>(value * lut_scale_ + .5f);
+    return lut_[Clamp(index, 0, kLutSize - 1)];
+  }
+
+  // The lookup table behind operator(): entry i is the 8-bit output of linear
+  // intensity i / lut_scale(). For pipelines that apply it themselves, e.g.
+  // in Halide.
+  const unsigned char* lut() const { return lut_.data(); }
+  int lut_size() const { return kLutSize; }
+  float lut_scale() const { return lut_scale_; }
+
+  // Produces a @width x @height output image, where @pixel(row, col) returns
+  // the linear RgbPixel of the image at (row, col). Rows are processed in
+  // parallel, so @pixel must be safe to call from several threads.
+  template<typename F>
+  std::unique_ptr<Image<Rgb8Pixel>> Run(int width, int height,
+                                        const F& pixel) const {
+    std::unique_ptr<Image<Rgb8Pixel>> image(new Image<Rgb8Pixel>(width, height));
+    ImageView<Rgb8Pixel> out = image->view();
+    ParallelFor(0, height, [&](int begin, int end) {
+      for (int row = begin; row < end; row++) {
+        Rgb8Pixel* out_row = out.row(row);
+        for (int col = 0; col < width; col++) {
+          const RgbPixel linear = pixel(row, col);
+          out_row[col] = Rgb8Pixel((*this)(linear.r), (*this)(linear.g),
+                                   (*this)(linear.b));
+        }
+      }
+    });
+    return image;
+  }
+
+  // Same as above, for a linear image that is already stored.
+  std::unique_ptr<Image<Rgb8Pixel>> Run(ImageView<const RgbPixel> linear) const;
+
+ private:
+  static constexpr int kLutSize = 1 << 14;
+
+  Opts opts_;
+  float lut_scale_;  // LUT entries per unit of linear intensity.
+  std::vector<unsigned char> lut_;
+};
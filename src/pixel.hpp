@@ -93,5 +93,19 @@ struct FloatPixel {
   T i = 0.;
 };
 
+// 8-bit RGB pixel of a final output image, 3 bytes per pixel. Channels are
+// stored in BMP (blue, green, red) order so that rows can be written out to a
+// BMP file as they are.
+struct Rgb8Pixel {
+  using T = unsigned char;
+
+  Rgb8Pixel() = default;
+  Rgb8Pixel(T r_in, T g_in, T b_in) : b(b_in), g(g_in), r(r_in) {}
+
+  T b = 0;
+  T g = 0;
+  T r = 0;
+};
+
 typedef Float3Pixel RgbPixel;
 typedef Float3Pixel YuvPixel;
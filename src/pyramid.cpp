@@ -0,0 +1,181 @@
+#include "pyramid.hpp"
+#include <algorithm>
+#include <array>
+#include <utility>
+#include "common.hpp"
+#include "kernel_tables.hpp"
+
+namespace {
+// Sum of @taps[k] * @at(k) over the taps, in order of k. Unrolled into
+// straight line code for a compile time tap count, so that loops around it
+// can vectorize.
+template<typename F, int... k>
+float UnrolledDot(const float* taps, const F& at,
+                  std::integer_sequence<int, k...>) {
+  float sum = 0.f;
+  ((sum += taps[k] * at(k)), ...);
+  return sum;
+}
+
+template<int kNumTaps, typename F>
+float Dot(const float* taps, int num_taps, const F& at) {
+  if constexpr (kNumTaps > 0) {
+    return UnrolledDot(taps, at, std::make_integer_sequence<int, kNumTaps>());
+  } else {
+    float sum = 0.f;
+    for (int k = 0; k < num_taps; k++) sum += taps[k] * at(k);
+    return sum;
+  }
+}
+
+// GaussianDownsample() with the @num_taps taps at @taps, or with the
+// compile time table of kNumTaps taps if kNumTaps > 0. Loops over the taps
+// then have constant bounds and coefficients, so they unroll.
+template<int kNumTaps>
+void Downsample(ImageView<const FloatPixel> image,
+                ImageView<FloatPixel> scratch, ImageView<FloatPixel> out,
+                const float* taps, int num_taps) {
+  static constexpr auto kTable =
+      kernel_tables::BinomialTaps<(kNumTaps > 0 ? kNumTaps : 1)>();
+  if (kNumTaps > 0) taps = kTable.data();
+  const int n = kNumTaps > 0 ? kNumTaps : num_taps;
+  const int half = n / 2;
+  const int width = image.width();
+  const int height = image.height();
+
+  // Separable filter: blur the rows of the input, keeping every other
+  // column, then blur the columns of that intermediate result, keeping every
+  // other row. Borders are clamped. Output columns whose taps are all inside
+  // of the row skip the clamping, and are filtered kBlock at a time into a
+  // local buffer: with a constant tap count, those are fixed size loops that
+  // don't alias the output, which the compiler vectorizes.
+  constexpr int kBlock = 16;
+  float block[kBlock];
+  const int inside_begin = std::min(out.width(), (half + 1) / 2);
+  const int inside_end = width - 1 - half < 0 ? inside_begin :
+      Clamp((width - 1 - half) / 2 + 1, inside_begin, out.width());
+  for (int row = 0; row < height; row++) {
+    const FloatPixel* in = image.row(row);
+    FloatPixel* blurred = scratch.row(row);
+    auto clamped = [&](int col) {
+      blurred[col].i = Dot<kNumTaps>(taps, n, [&](int k) {
+        return in[Clamp(2 * col + k - half, 0, width - 1)].i;
+      });
+    };
+    for (int col = 0; col < inside_begin; col++) clamped(col);
+    int col = inside_begin;
+    for (; col + kBlock <= inside_end; col += kBlock) {
+      const FloatPixel* window = in + 2 * col - half;
+      for (int i = 0; i < kBlock; i++) {
+        block[i] = Dot<kNumTaps>(taps, n,
+                                 [&](int k) { return window[2 * i + k].i; });
+      }
+      for (int i = 0; i < kBlock; i++) blurred[col + i].i = block[i];
+    }
+    for (; col < inside_end; col++) {
+      const FloatPixel* window = in + 2 * col - half;
+      blurred[col].i =
+          Dot<kNumTaps>(taps, n, [&](int k) { return window[k].i; });
+    }
+    for (col = inside_end; col < out.width(); col++) clamped(col);
+  }
+  std::vector<const FloatPixel*> rows(n);
+  for (int row = 0; row < out.height(); row++) {
+    for (int k = 0; k < n; k++)
+      rows[k] = scratch.row(Clamp(2 * row + k - half, 0, height - 1));
+    FloatPixel* out_row = out.row(row);
+    int col = 0;
+    for (; col + kBlock <= out.width(); col += kBlock) {
+      for (int i = 0; i < kBlock; i++) {
+        block[i] = Dot<kNumTaps>(taps, n,
+                                 [&](int k) { return rows[k][col + i].i; });
+      }
+      for (int i = 0; i < kBlock; i++) out_row[col + i].i = block[i];
+    }
+    for (; col < out.width(); col++) {
+      out_row[col].i =
+          Dot<kNumTaps>(taps, n, [&](int k) { return rows[k][col].i; });
+    }
+  }
+}
+
+// Sizes of the levels of a pyramid over a @width x @height base level.
+std::vector<std::array<int, 2>> LevelSizes(int width, int height,
+                                           int num_levels, int min_size) {
+  std::vector<std::array<int, 2>> sizes = {{width, height}};
+  while (static_cast<int>(sizes.size()) < num_levels) {
+    width /= 2;
+    height /= 2;
+    if (width < min_size || height < min_size) break;
+    sizes.push_back({width, height});
+  }
+  return sizes;
+}
+
+int TotalHeight(const std::vector<std::array<int, 2>>& sizes) {
+  int height = 0;
+  for (const auto& size : sizes) height += size[1];
+  return height;
+}
+}  // namespace
+
+void BayerToGray(SensorView<const CameraSensor::T> raw,
+                 ImageView<FloatPixel> gray) {
+  auto value = [&raw](int row, int col) {
+    return Clamp(raw(row, col), 0.f, 1.f);
+  };
+  for (int row = 0; row < gray.height(); row++) {
+    for (int col = 0; col < gray.width(); col++) {
+      gray(row, col).i = .25f * (
+          value(2 * row, 2 * col) + value(2 * row, 2 * col + 1) +
+          value(2 * row + 1, 2 * col) + value(2 * row + 1, 2 * col + 1));
+    }
+  }
+}
+
+void GaussianDownsample(ImageView<const FloatPixel> image,
+                        ImageView<FloatPixel> scratch,
+                        ImageView<FloatPixel> out, int taps) {
+  switch (taps) {
+    case 3: return Downsample<3>(image, scratch, out, nullptr, 0);
+    case 5: return Downsample<5>(image, scratch, out, nullptr, 0);
+    case 7: return Downsample<7>(image, scratch, out, nullptr, 0);
+    default: return GaussianDownsampleGeneric(image, scratch, out, taps);
+  }
+}
+
+void GaussianDownsampleGeneric(ImageView<const FloatPixel> image,
+                               ImageView<FloatPixel> scratch,
+                               ImageView<FloatPixel> out, int taps) {
+  const std::vector<float> table = kernel_tables::BinomialTaps(taps);
+  Downsample<0>(image, scratch, out, table.data(), taps);
+}
+
+Pyramid::Pyramid(int raw_width, int raw_height, int num_levels, int min_size)
+    : storage_(raw_width / 2,
+               TotalHeight(LevelSizes(raw_width / 2, raw_height / 2,
+                                      num_levels, min_size))),
+      scratch_(std::max(1, raw_width / 4), raw_height / 2) {
+  int top = 0;
+  for (const auto& size : LevelSizes(raw_width / 2, raw_height / 2,
+                                     num_levels, min_size)) {
+    levels_.push_back(storage_.View(0, top, size[0], size[1]));
+    top += size[1];
+  }
+}
+
+// static
+size_t Pyramid::Bytes(int raw_width, int raw_height, int num_levels,
+                      int min_size) {
+  const int storage_height = TotalHeight(
+      LevelSizes(raw_width / 2, raw_height / 2, num_levels, min_size));
+  return sizeof(FloatPixel) *
+      (static_cast<size_t>(raw_width / 2) * storage_height +
+       static_cast<size_t>(std::max(1, raw_width / 4)) * (raw_height / 2));
+}
+
+void Pyramid::Build(SensorView<const CameraSensor::T> raw) {
+  BayerToGray(raw, levels_[0]);
+  for (int i = 1; i < num_levels(); i++)
+    GaussianDownsample(levels_[i - 1], scratch_.view(), levels_[i]);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include "camera_sensor.hpp"
+#include "image.hpp"
+#include "pixel.hpp"
+#include "view.hpp"
+
+// Converts Bayer mosaic @raw to the half resolution grayscale image @gray by
+// averaging each 2x2 quad. Values are clamped to [0, 1] first, so that
+// uncorrected defects do not dominate the average.
+void BayerToGray(SensorView<const CameraSensor::T> raw,
+                 ImageView<FloatPixel> gray);
+
+// Blurs @image with a binomial (approximately Gaussian) filter of @taps
+// taps, an odd number, and writes every other pixel of the result to @out,
+// which must be half the size of @image. @scratch holds the horizontally
+// filtered rows and must be at least @out.width() x @image.height(). 3, 5
+// and 7 taps run kernels specialized for their tap count at compile time,
+// other counts GaussianDownsampleGeneric().
+void GaussianDownsample(ImageView<const FloatPixel> image,
+                        ImageView<FloatPixel> scratch,
+                        ImageView<FloatPixel> out, int taps = 5);
+
+// GaussianDownsample() for any tap count, with taps computed at runtime.
+// Gives the same results as the specialized kernels.
+void GaussianDownsampleGeneric(ImageView<const FloatPixel> image,
+                               ImageView<FloatPixel> scratch,
+                               ImageView<FloatPixel> out, int taps);
+
+// Grayscale Gaussian pyramid of a Bayer frame. Level 0 is the half
+// resolution grayscale image of the frame, and each following level is half
+// the width and height of the previous one. All levels are views into a
+// single buffer, allocated once, so a pyramid can be rebuilt for every frame
+// of a burst without allocating.
+class Pyramid {
+ public:
+  // Allocates a pyramid for Bayer frames of @raw_width x @raw_height, with up
+  // to @num_levels levels, stopping early once a level would be smaller than
+  // @min_size pixels in either dimension.
+  Pyramid(int raw_width, int raw_height, int num_levels, int min_size = 8);
+
+  // Builds all levels from Bayer frame @raw, which must have the size given
+  // to the constructor.
+  void Build(SensorView<const CameraSensor::T> raw);
+
+  // Bytes allocated by a pyramid constructed with the same arguments.
+  static size_t Bytes(int raw_width, int raw_height, int num_levels,
+                      int min_size = 8);
+
+  int num_levels() const { return levels_.size(); }
+  ImageView<const FloatPixel> level(int i) const { return levels_[i]; }
+
+ private:
+  // Disallow copy and assign.
+  Pyramid(Pyramid&);
+  void operator=(const Pyramid&);
+
+  Image<FloatPixel> storage_;  // levels stacked vertically.
+  Image<FloatPixel> scratch_;  // for GaussianDownsample().
+  std::vector<ImageView<FloatPixel>> levels_;
+};
@@ -0,0 +1,155 @@
+#include "render_farm.hpp"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include "common.hpp"
+
+namespace {
+// Coordinator to worker.
+struct Job {
+  int shot;
+};
+
+// Worker to coordinator, followed by width * height Rgb8Pixels.
+struct Result {
+  int shot;
+  int width;   // 0 if the picture could not be taken.
+  int height;
+};
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    // MSG_NOSIGNAL: a dead peer is reported as an error, not a SIGPIPE.
+    const ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (written <= 0) return false;
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void* data, size_t size) {
+  char* bytes = static_cast<char*>(data);
+  while (size > 0) {
+    const ssize_t read = recv(fd, bytes, size, 0);
+    if (read <= 0) return false;
+    bytes += read;
+    size -= read;
+  }
+  return true;
+}
+}  // namespace
+
+// static
+std::unique_ptr<RenderFarm> RenderFarm::Start(
+    const SharedScene& scene, const PipelineFactory& new_pipeline,
+    const Opts& opts) {
+  std::unique_ptr<RenderFarm> farm(new RenderFarm(opts));
+  // Output still buffered now would be written again by every worker.
+  std::cout.flush();
+  std::fflush(stdout);
+  const int num_threads =
+      std::max(1, ParallelForThreads() / std::max(1, opts.num_workers));
+  for (int i = 0; i < opts.num_workers; i++) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) return nullptr;
+    const pid_t pid = fork();
+    if (pid < 0) {
+      close(sockets[0]);
+      close(sockets[1]);
+      return nullptr;
+    }
+    if (pid == 0) {
+      // The worker only keeps its own end of its own socket. It leaves with
+      // _exit() so that none of the coordinator's objects it inherited (the
+      // scene among them) are destroyed twice. _exit() doesn't flush stdio,
+      // so the worker flushes its own output first.
+      close(sockets[0]);
+      for (const auto& worker : farm->workers_) close(worker.socket);
+      ParallelForThreads() = num_threads;
+      const int status = WorkerMain(scene.name(), new_pipeline, sockets[1]);
+      std::cout.flush();
+      std::fflush(stdout);
+      _exit(status);
+    }
+    close(sockets[1]);
+    farm->workers_.push_back({pid, sockets[0]});
+  }
+  return farm;
+}
+
+RenderFarm::~RenderFarm() {
+  // Workers exit when they see their socket closed.
+  for (const auto& worker : workers_) close(worker.socket);
+  for (const auto& worker : workers_) waitpid(worker.pid, nullptr, 0);
+}
+
+// static
+int RenderFarm::WorkerMain(const std::string& scene_name,
+                           const PipelineFactory& new_pipeline, int socket) {
+  std::shared_ptr<const SharedScene> scene = SharedScene::Attach(scene_name);
+  if (not scene) return 1;
+  auto sensor = CameraSensor::New(scene);
+  auto pipeline = new_pipeline(sensor.get());
+
+  Job job;
+  while (ReadAll(socket, &job, sizeof(job))) {
+    const auto image = pipeline->TakePicture();
+    const Result result = {job.shot, image ? image->width() : 0,
+                           image ? image->height() : 0};
+    if (not WriteAll(socket, &result, sizeof(result))) return 1;
+    if (image && not WriteAll(socket, image->view().row(0),
+                              sizeof(Rgb8Pixel) * result.width *
+                              result.height))
+      return 1;
+  }
+  close(socket);
+  return 0;
+}
+
+bool RenderFarm::Render(int num_shots, const ResultCallback& callback) {
+  int next_shot = 0;
+  int done = 0;
+  std::vector<int> queued(workers_.size(), 0);
+  auto send_job = [&](int i) {
+    const Job job = {next_shot};
+    if (not WriteAll(workers_[i].socket, &job, sizeof(job))) return false;
+    next_shot++;
+    queued[i]++;
+    return true;
+  };
+
+  std::vector<pollfd> fds;
+  for (int i = 0; i < num_workers(); i++) {
+    fds.push_back({workers_[i].socket, POLLIN, 0});
+    while (queued[i] < opts_.jobs_per_worker && next_shot < num_shots)
+      if (not send_job(i)) return false;
+  }
+
+  while (done < num_shots) {
+    if (poll(fds.data(), fds.size(), -1) < 0) return false;
+    for (int i = 0; i < num_workers(); i++) {
+      if (not (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      Result result;
+      if (queued[i] == 0 || not ReadAll(fds[i].fd, &result, sizeof(result)))
+        return false;
+      std::unique_ptr<Image<Rgb8Pixel>> image;
+      if (result.width > 0 && result.height > 0) {
+        image.reset(new Image<Rgb8Pixel>(result.width, result.height));
+        if (not ReadAll(fds[i].fd, image->view().row(0),
+                        sizeof(Rgb8Pixel) * result.width * result.height))
+          return false;
+      }
+      queued[i]--;
+      done++;
+      callback(result.shot, std::move(image));
+      if (next_shot < num_shots && not send_job(i)) return false;
+    }
+  }
+  return true;
+}
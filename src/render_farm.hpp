@@ -0,0 +1,71 @@
+#pragma once
+
+#include <sys/types.h>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "camera_pipeline_interface.hpp"
+#include "shared_scene.hpp"
+
+// Renders shots of one scene on a pool of local worker processes. The scene
+// is loaded once into shared memory (SharedScene) by the coordinator, and
+// every worker attaches to it, so adding workers adds no scene memory. Each
+// worker is connected to the coordinator by a Unix domain socket, over which
+// it receives shot numbers and returns the finished 8-bit images.
+class RenderFarm {
+ public:
+  struct Opts {
+    int num_workers = 2;
+    // Shots queued on each worker's socket, so a worker starts its next shot
+    // without waiting for the coordinator to receive the last one.
+    int jobs_per_worker = 2;
+  };
+
+  // Builds the pipeline of a worker for its sensor. Called once in every
+  // worker process.
+  using PipelineFactory =
+      std::function<std::unique_ptr<CameraPipelineInterface>(CameraSensor*)>;
+
+  // Called in the coordinator with each finished shot, in completion order.
+  // @image is nullptr if the worker could not take the picture.
+  using ResultCallback =
+      std::function<void(int shot, std::unique_ptr<Image<Rgb8Pixel>> image)>;
+
+  // Forks @opts.num_workers workers rendering @scene with pipelines from
+  // @new_pipeline. Workers split the hardware threads between them. Must be
+  // called before the coordinator starts any threads. Returns nullptr if the
+  // workers can't be started.
+  static std::unique_ptr<RenderFarm> Start(const SharedScene& scene,
+                                           const PipelineFactory& new_pipeline,
+                                           const Opts& opts);
+
+  // Stops the workers and waits for them to exit.
+  ~RenderFarm();
+
+  // Renders shots 0 to @num_shots - 1 on the workers. Returns false if a
+  // worker died, in which case not every shot was reported.
+  bool Render(int num_shots, const ResultCallback& callback);
+
+  int num_workers() const { return workers_.size(); }
+
+ private:
+  struct Worker {
+    pid_t pid;
+    int socket;  // coordinator's end.
+  };
+
+  explicit RenderFarm(const Opts& opts) : opts_(opts) {}
+
+  // Disallow copy and assign.
+  RenderFarm(RenderFarm&);
+  void operator=(const RenderFarm&);
+
+  // Main loop of a worker process: attaches to the scene @scene_name and
+  // renders the shots requested on @socket until the coordinator closes it.
+  // Returns the exit status of the worker.
+  static int WorkerMain(const std::string& scene_name,
+                        const PipelineFactory& new_pipeline, int socket);
+
+  const Opts opts_;
+  std::vector<Worker> workers_;
+};
@@ -0,0 +1,212 @@
+#include "sensor_calibration.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "common.hpp"
+
+namespace {
+constexpr char kMagic[] = "kcamera-calibration";
+constexpr int kVersion = 1;
+
+// Average of the valid same-color neighbors of (@row, @col) in @raw. Defective
+// photosites read out outside of [0, 1], so they never contribute.
+template<typename T>
+T NeighborAverage(SensorView<const T> raw, int row, int col) {
+  static const int offsets[4][2] = {{-2, 0}, {2, 0}, {0, -2}, {0, 2}};
+  T sum = 0.f;
+  int count = 0;
+  for (const auto& offset : offsets) {
+    const int r = row + offset[0];
+    const int c = col + offset[1];
+    if (r < 0 || c < 0 || r >= raw.height() || c >= raw.width()) continue;
+    const T value = raw.data(r, c);
+    if (value < 0.f || value > 1.f) continue;
+    sum += value;
+    count++;
+  }
+  return count > 0 ? sum / count : 0.f;
+}
+}  // namespace
+
+// static
+std::unique_ptr<SensorCalibration> SensorCalibration::Measure(
+    CameraSensor* sensor, const std::string& scene_key, const Opts& opts) {
+  const int width = sensor->GetSensorWidth();
+  const int height = sensor->GetSensorHeight();
+  std::unique_ptr<SensorCalibration> calibration(
+      new SensorCalibration(scene_key, width, height));
+
+  auto average_frames = [&](int num_frames) {
+    std::vector<T> mean(width * height, 0.f);
+    for (int i = 0; i < num_frames; i++) {
+      auto frame = sensor->GetSensorData(0, 0, width, height);
+      for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+          mean[row * width + col] += frame->data(row, col);
+        }
+      }
+    }
+    for (auto& value : mean) value /= std::max(1, num_frames);
+    return mean;
+  };
+
+  sensor->SetFlatField(false);
+  sensor->SetLensCap(true);
+  const std::vector<T> dark = average_frames(opts.num_dark_frames);
+  sensor->SetLensCap(false);
+  sensor->SetFlatField(true);
+  const std::vector<T> flat = average_frames(opts.num_flat_frames);
+  sensor->SetFlatField(false);
+
+  // Reference flat level, over photosites that behave in the dark frames.
+  double flat_sum = 0.;
+  int flat_count = 0;
+  for (int i = 0; i < width * height; i++) {
+    if (dark[i] > opts.dark_threshold || flat[i] > 1.f) continue;
+    flat_sum += flat[i];
+    flat_count++;
+  }
+  const T flat_level = flat_count > 0 ? flat_sum / flat_count : 0.f;
+
+  for (int row = 0; row < height; row++) {
+    double row_sum = 0.;
+    int row_count = 0;
+    for (int col = 0; col < width; col++) {
+      const int i = row * width + col;
+      if (dark[i] > opts.dark_threshold ||
+          std::abs(flat[i] - flat_level) > opts.flat_tolerance * flat_level) {
+        calibration->defects_.push_back({row, col});
+        continue;
+      }
+      row_sum += flat[i];
+      row_count++;
+    }
+    if (row_count == 0 || flat_level <= 0.f) continue;
+    const T gain = row_sum / row_count / flat_level;
+    if (std::abs(gain - 1.f) > opts.row_gain_tolerance)
+      calibration->row_gains_[row] = gain;
+  }
+
+  std::cout << "Calibration: " << calibration->defects_.size()
+            << " defective pixels, " << calibration->row_gains_.size()
+            << " rows with gain" << std::endl;
+  return calibration;
+}
+
+// static
+std::unique_ptr<SensorCalibration> SensorCalibration::Load(
+    const std::string& filename, const std::string& scene_key,
+    int width, int height) {
+  std::ifstream in(filename);
+  if (not in.good()) return nullptr;
+
+  std::string magic, key;
+  int version = 0, file_width = 0, file_height = 0;
+  in >> magic >> version >> std::ws;
+  std::getline(in, key);
+  in >> file_width >> file_height;
+  if (not in || magic != kMagic || version != kVersion) {
+    std::cout << "Ignoring malformed calibration file " << filename
+              << std::endl;
+    return nullptr;
+  }
+  if (key != scene_key || file_width != width || file_height != height) {
+    std::cout << "Ignoring calibration file " << filename
+              << " measured for " << key << std::endl;
+    return nullptr;
+  }
+
+  std::unique_ptr<SensorCalibration> calibration(
+      new SensorCalibration(scene_key, width, height));
+  int num_defects = 0;
+  in >> num_defects;
+  for (int i = 0; in && i < num_defects; i++) {
+    std::array<int, 2> defect;
+    in >> defect[0] >> defect[1];
+    calibration->defects_.push_back(defect);
+  }
+  int num_row_gains = 0;
+  in >> num_row_gains;
+  for (int i = 0; in && i < num_row_gains; i++) {
+    int row;
+    T gain;
+    in >> row >> gain;
+    calibration->row_gains_[row] = gain;
+  }
+  if (not in) {
+    std::cout << "Ignoring truncated calibration file " << filename
+              << std::endl;
+    return nullptr;
+  }
+  return calibration;
+}
+
+bool SensorCalibration::Save(const std::string& filename) const {
+  std::ofstream out(filename);
+  if (not out.good()) return false;
+  out << kMagic << " " << kVersion << "\n"
+      << scene_key_ << "\n"
+      << width_ << " " << height_ << "\n"
+      << defects_.size() << "\n";
+  for (const auto& defect : defects_)
+    out << defect[0] << " " << defect[1] << "\n";
+  out << row_gains_.size() << "\n";
+  out.precision(9);
+  for (const auto& row_gain : row_gains_)
+    out << row_gain.first << " " << row_gain.second << "\n";
+  return out.good();
+}
+
+// static
+std::string SensorCalibration::SceneKey(const std::string& scene_filename) {
+  const size_t slash = scene_filename.find_last_of('/');
+  const std::string basename = slash == std::string::npos ?
+      scene_filename : scene_filename.substr(slash + 1);
+  std::ostringstream key;
+  key << basename << ":" << std::hex << CameraSensorImpl::HashScene(scene_filename);
+  return key.str();
+}
+
+// static
+std::string SensorCalibration::DefaultPath(const std::string& scene_filename) {
+  const size_t slash = scene_filename.find_last_of('/');
+  const size_t dot = scene_filename.find_last_of('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return scene_filename + ".calib";
+  return scene_filename.substr(0, dot) + ".calib";
+}
+
+void SensorCalibration::Apply(SensorView<T> raw, int left, int top,
+                              int bin) const {
+  bin = std::max(1, bin);
+  const int block = 2 * bin;
+  // Maps a sensor row/column, relative to the crop window, to the
+  // row/column of @raw it was binned into, or -1 if it is outside of it.
+  auto binned = [block](int i) {
+    return i < 0 ? -1 : (i / block) * 2 + (i % 2);
+  };
+
+  // A binned row is the average of @bin same-color sensor rows.
+  std::map<int, T> gains;
+  for (const auto& row_gain : row_gains_) {
+    const int row = binned(row_gain.first - top);
+    if (row >= 0) gains[row] += (row_gain.second - 1.f) / bin;
+  }
+  for (const auto& row_gain : gains) {
+    const int row = row_gain.first;
+    if (row >= raw.height()) continue;
+    const T scale = 1.f / (1.f + row_gain.second);
+    T* values = raw.row(row);
+    for (int col = 0; col < raw.width(); col++) values[col] *= scale;
+  }
+
+  for (const auto& defect : defects_) {
+    const int row = binned(defect[0] - top);
+    const int col = binned(defect[1] - left);
+    if (row < 0 || col < 0 || row >= raw.height() || col >= raw.width())
+      continue;
+    raw(row, col) = NeighborAverage<T>(raw, row, col);
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "camera_sensor.hpp"
+
+// Static sensor defects of a scene, measured once from dark and flat frames
+// and reused for every shot of that scene. Defects are stored sparsely: a list
+// of defective photosites and the gains of the rows whose response differs
+// measurably from the rest of the sensor.
+class SensorCalibration {
+ public:
+  using T = typename CameraSensor::T;
+
+  struct Opts {
+    int num_dark_frames = 8;
+    int num_flat_frames = 8;
+    // A photosite is defective if its mean dark frame value is above
+    // @dark_threshold, or its mean flat frame value is off by more than
+    // @flat_tolerance (relative) from the mean flat frame value.
+    T dark_threshold = .25f;
+    T flat_tolerance = .5f;
+    // Only rows whose relative gain differs from 1 by more than this are kept.
+    T row_gain_tolerance = .005f;
+  };
+
+  // Measures the calibration of @sensor by capturing dark frames (lens cap
+  // on) and flat frames (flat field target). @sensor is left with the lens
+  // cap off and the flat field target removed. @scene_key identifies the
+  // scene the sensor was created from; see SceneKey().
+  static std::unique_ptr<SensorCalibration> Measure(
+      CameraSensor* sensor, const std::string& scene_key, const Opts& opts);
+
+  // Loads a calibration previously written by Save(). Returns nullptr if the
+  // file can't be read or was measured for a different scene or sensor size.
+  static std::unique_ptr<SensorCalibration> Load(
+      const std::string& filename, const std::string& scene_key,
+      int width, int height);
+
+  bool Save(const std::string& filename) const;
+
+  // Key identifying the scene file @scene_filename by its name and a hash of
+  // the sensor data in it (see CameraSensorImpl::HashScene()), used to make
+  // sure a calibration file is only applied to the scene it was measured
+  // for. Hashing reads all raw planes, so only compute it when needed.
+  static std::string SceneKey(const std::string& scene_filename);
+
+  // Default location of the calibration file for @scene_filename: the scene
+  // file with its extension replaced by ".calib".
+  static std::string DefaultPath(const std::string& scene_filename);
+
+  // Corrects @raw in place: defective photosites are replaced by the average
+  // of their valid same-color neighbors and rows with a gain are rescaled.
+  // @raw is a readout of the crop window at @left, @top binned by @bin (1
+  // for no binning), as returned by
+  // CameraSensor::GetBinnedSensorData(left, top, width, height, bin).
+  // Defects are at sensor coordinates, so they are offset by the window.
+  void Apply(SensorView<T> raw, int left = 0, int top = 0, int bin = 1) const;
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  const std::vector<std::array<int, 2>>& defects() const { return defects_; }
+  const std::map<int, T>& row_gains() const { return row_gains_; }
+
+ private:
+  SensorCalibration(std::string scene_key, int width, int height)
+      : scene_key_(std::move(scene_key)), width_(width), height_(height) {}
+
+  const std::string scene_key_;
+  const int width_;
+  const int height_;
+  std::vector<std::array<int, 2>> defects_;  // {row, col}, sorted.
+  std::map<int, T> row_gains_;                // row -> relative gain.
+};
@@ -0,0 +1,135 @@
+#include "shared_scene.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+
+// Layout of the shared memory object: this header, then the raw planes one
+// after the other, starting at offset @planes_offset.
+struct SharedScene::Header {
+  static constexpr int kMaxPlanes = 64;
+  static constexpr int kMaxFilename = 1024;
+
+  // Planes start on a cache line boundary after the header.
+  static constexpr size_t PlanesOffset() {
+    return (sizeof(Header) + 63) & ~static_cast<size_t>(63);
+  }
+
+  char magic[16];
+  int num_planes;
+  int width;
+  int height;
+  CameraSensorImpl::Opts opts;
+  size_t planes_offset;
+  long perfect_image_offsets[kMaxPlanes];
+  char filename[kMaxFilename];
+};
+
+namespace {
+constexpr char kMagic[16] = "kcamera-scene";
+
+// Returns a shared memory object name unique to this process and call.
+std::string UniqueName() {
+  static std::atomic<int> counter(0);
+  return "/kcamera-scene-" + std::to_string(getpid()) + "-" +
+      std::to_string(counter++);
+}
+}  // namespace
+
+// static
+std::unique_ptr<SharedScene> SharedScene::Create(const std::string& filename) {
+  if (filename.size() >= Header::kMaxFilename) return nullptr;
+  std::unique_ptr<SharedScene> scene(new SharedScene(UniqueName(), true));
+
+  // The object is sized and mapped once the header of the scene file tells
+  // how large its planes are.
+  auto allocate = [&scene](int num_planes, int width, int height) -> T* {
+    if (num_planes > Header::kMaxPlanes) return nullptr;
+    const int fd =
+        shm_open(scene->name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return nullptr;
+    const size_t bytes =
+        Header::PlanesOffset() + sizeof(T) * num_planes * width * height;
+    void* data = ftruncate(fd, bytes) == 0
+        ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) return nullptr;
+    scene->data_ = data;
+    scene->bytes_ = bytes;
+    return reinterpret_cast<T*>(static_cast<char*>(data) + Header::PlanesOffset());
+  };
+  CameraSensorImpl::SceneInfo info;
+  if (not CameraSensorImpl::ReadScene(filename, allocate, &info))
+    return nullptr;
+
+  Header& header = *static_cast<Header*>(scene->data_);
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.num_planes = info.planes.size();
+  header.width = info.width;
+  header.height = info.height;
+  header.opts = info.opts;
+  header.planes_offset = Header::PlanesOffset();
+  for (int i = 0; i < header.num_planes; i++)
+    header.perfect_image_offsets[i] = info.planes[i].perfect_image_offset;
+  std::strncpy(header.filename, filename.c_str(), Header::kMaxFilename - 1);
+  header.filename[Header::kMaxFilename - 1] = '\0';
+
+  // Nobody writes to the scene from now on.
+  mprotect(scene->data_, scene->bytes_, PROT_READ);
+  return scene;
+}
+
+// static
+std::unique_ptr<SharedScene> SharedScene::Attach(const std::string& name) {
+  std::unique_ptr<SharedScene> scene(new SharedScene(name, false));
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  void* data = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= Header::PlanesOffset()
+      ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0)
+      : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) return nullptr;
+  scene->data_ = data;
+  scene->bytes_ = st.st_size;
+
+  const Header& header = scene->header();
+  const size_t plane_bytes =
+      sizeof(T) * static_cast<size_t>(header.width) * header.height;
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.num_planes <= 0 || header.num_planes > Header::kMaxPlanes ||
+      header.planes_offset + header.num_planes * plane_bytes > scene->bytes_)
+    return nullptr;
+  return scene;
+}
+
+SharedScene::~SharedScene() {
+  if (data_) munmap(data_, bytes_);
+  if (owner_) shm_unlink(name_.c_str());
+}
+
+std::string SharedScene::filename() const {
+  const Header& header = this->header();
+  return std::string(header.filename,
+                     strnlen(header.filename, Header::kMaxFilename));
+}
+
+CameraSensorImpl::SceneInfo SharedScene::info() const {
+  const Header& header = this->header();
+  CameraSensorImpl::SceneInfo info;
+  info.width = header.width;
+  info.height = header.height;
+  info.opts = header.opts;
+  info.planes.resize(header.num_planes);
+  const T* plane = reinterpret_cast<const T*>(
+      static_cast<const char*>(data_) + header.planes_offset);
+  for (int i = 0; i < header.num_planes; i++) {
+    info.planes[i].buffer = plane + static_cast<size_t>(i) * header.width *
+        header.height;
+    info.planes[i].perfect_image_offset = header.perfect_image_offsets[i];
+  }
+  return info;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include "camera_sensor.hpp"
+
+// The raw planes and metadata of a scene file, loaded once into a POSIX
+// shared memory object that any number of processes map read-only. Sensors
+// created from a SharedScene (CameraSensor::New(scene)) read its planes in
+// place, so processes rendering the same scene share one copy of it.
+class SharedScene {
+ public:
+  using T = typename CameraSensor::T;
+
+  // Loads scene file @filename into a new shared memory object. The object
+  // is removed when the returned SharedScene is destroyed; processes that
+  // still have it mapped keep their mapping. Returns nullptr on error.
+  static std::unique_ptr<SharedScene> Create(const std::string& filename);
+
+  // Maps the shared memory object @name of a SharedScene created by another
+  // process. Returns nullptr on error.
+  static std::unique_ptr<SharedScene> Attach(const std::string& name);
+
+  ~SharedScene();
+
+  // Name of the shared memory object, for Attach().
+  const std::string& name() const { return name_; }
+
+  // Scene file the scene was loaded from, which still holds the perfect
+  // images.
+  std::string filename() const;
+
+  // Size of the shared memory object in bytes.
+  size_t bytes() const { return bytes_; }
+
+  // The scene, with plane buffers pointing into the shared memory.
+  CameraSensorImpl::SceneInfo info() const;
+
+ private:
+  struct Header;
+
+  SharedScene(std::string name, bool owner) : name_(name), owner_(owner) {}
+
+  // Disallow copy and assign.
+  SharedScene(SharedScene&);
+  void operator=(const SharedScene&);
+
+  const Header& header() const {
+    return *static_cast<const Header*>(data_);
+  }
+
+  const std::string name_;
+  const bool owner_;  // unlinks the object when destroyed.
+  void* data_ = nullptr;
+  size_t bytes_ = 0;
+};
@@ -0,0 +1,123 @@
+#include "stage_cache.hpp"
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+constexpr char kMagic[16] = "kcamera-stage";
+
+// Reads sensor data written by WriteSensorData(), or returns nullptr.
+template<typename T>
+std::unique_ptr<CameraSensorData<T>> ReadSensorData(const std::string& path) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (not f) return nullptr;
+  char magic[sizeof(kMagic)];
+  int size[2];
+  std::unique_ptr<CameraSensorData<T>> data;
+  if (fread(magic, sizeof(magic), 1, f) == 1 &&
+      std::memcmp(magic, kMagic, sizeof(kMagic)) == 0 &&
+      fread(size, sizeof(size), 1, f) == 1 && size[0] > 0 && size[1] > 0) {
+    data.reset(new CameraSensorData<T>(size[0], size[1]));
+    const size_t count = static_cast<size_t>(size[0]) * size[1];
+    if (fread(data->view().row(0), sizeof(T), count, f) != count)
+      data.reset();
+  }
+  fclose(f);
+  return data;
+}
+
+// Writes @data to @path. The file is written under a temporary name and
+// renamed, so that readers never see a partial file.
+template<typename T>
+bool WriteSensorData(const std::string& path, const CameraSensorData<T>& data) {
+  const std::string temp_path = path + ".tmp" + std::to_string(getpid());
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (not f) return false;
+  const int size[2] = {data.width(), data.height()};
+  const size_t count = static_cast<size_t>(size[0]) * size[1];
+  bool written = fwrite(kMagic, sizeof(kMagic), 1, f) == 1 &&
+      fwrite(size, sizeof(size), 1, f) == 1 &&
+      fwrite(data.view().row(0), sizeof(T), count, f) == count;
+  written = fclose(f) == 0 && written;
+  if (written) written = rename(temp_path.c_str(), path.c_str()) == 0;
+  if (not written) remove(temp_path.c_str());
+  return written;
+}
+}  // namespace
+
+std::string StageKey::ToString() const {
+  std::ostringstream out;
+  out << std::hex << std::setw(16) << std::setfill('0') << hash_;
+  return out.str();
+}
+
+// static
+std::unique_ptr<StageCache> StageCache::Open(const std::string& directory) {
+  if (not directory.empty()) {
+    if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+      return nullptr;
+    struct stat info;
+    if (stat(directory.c_str(), &info) != 0 || not S_ISDIR(info.st_mode) ||
+        access(directory.c_str(), W_OK | X_OK) != 0)
+      return nullptr;
+  }
+  return std::unique_ptr<StageCache>(new StageCache(directory));
+}
+
+std::string StageCache::Path(const std::string& stage,
+                             const StageKey& key) const {
+  return directory_ + "/" + stage + "-" + key.ToString() + ".raw";
+}
+
+std::unique_ptr<CameraSensorData<typename StageCache::T>> StageCache::Get(
+    const std::string& stage, const StageKey& key) {
+  const std::string name = stage + "-" + key.ToString();
+  std::lock_guard<std::mutex> lock(mutex_);
+  Stats& stats = stats_[stage];
+  auto entry = entries_.find(name);
+  if (entry == entries_.end() && not directory_.empty()) {
+    std::shared_ptr<const CameraSensorData<T>> data =
+        ReadSensorData<T>(Path(stage, key));
+    if (data) {
+      stats.disk_hits++;
+      entry = entries_.emplace(name, std::move(data)).first;
+    }
+  }
+  if (entry == entries_.end()) {
+    stats.misses++;
+    return nullptr;
+  }
+  stats.hits++;
+  return entry->second->Clone();
+}
+
+void StageCache::Put(const std::string& stage, const StageKey& key,
+                     const CameraSensorData<T>& data) {
+  std::shared_ptr<const CameraSensorData<T>> copy = data.Clone();
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (not directory_.empty() && not WriteSensorData(Path(stage, key), *copy))
+    stats_[stage].write_errors++;
+  entries_[stage + "-" + key.ToString()] = std::move(copy);
+}
+
+std::map<std::string, StageCache::Stats> StageCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void StageCache::Print(std::ostream& out) const {
+  for (const auto& stage : stats()) {
+    out << "Stage cache " << stage.first << ": " << stage.second.hits
+        << " hits (" << stage.second.disk_hits << " from disk), "
+        << stage.second.misses << " misses";
+    if (stage.second.write_errors > 0) {
+      out << ", " << stage.second.write_errors << " not written to "
+          << directory_;
+    }
+    out << std::endl;
+  }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include "camera_sensor.hpp"
+#include "common.hpp"
+
+// Identifies the output of a pipeline stage by content: a hash of the
+// stage's inputs and parameters. A stage's key starts from the key of the
+// stage feeding it, so it changes whenever anything upstream changes.
+class StageKey {
+ public:
+  // Key of the first stage of a pipeline.
+  StageKey() = default;
+
+  // Key of a stage fed by the stage with key @upstream.
+  static StageKey After(const StageKey& upstream) { return upstream; }
+
+  // Adds parameter @value of the stage to the key.
+  template<typename V>
+  StageKey& Add(const V& value) {
+    static_assert(std::is_trivially_copyable<V>::value,
+                  "add the fields of non-trivial parameters one by one");
+    hash_ = Fnv1a(&value, sizeof(value), hash_);
+    return *this;
+  }
+  StageKey& Add(const std::string& value) {
+    Add(value.size());
+    hash_ = Fnv1a(value.data(), value.size(), hash_);
+    return *this;
+  }
+
+  uint64_t hash() const { return hash_; }
+
+  // The hash as 16 hexadecimal digits.
+  std::string ToString() const;
+
+ private:
+  uint64_t hash_ = 14695981039346656037ull;
+};
+
+// Content-addressed cache of intermediate sensor data of a pipeline (e.g. the
+// merged burst), so that re-rendering a capture with different parameters of
+// later stages only reruns those. Entries are kept in memory, and also
+// written to and read from files in a directory if one is given, so they
+// outlive the process. Safe to use from several threads.
+class StageCache {
+ public:
+  using T = typename CameraSensor::T;
+
+  struct Stats {
+    int hits = 0;       // in memory or on disk.
+    int disk_hits = 0;  // of the hits, read from disk.
+    int misses = 0;
+    int write_errors = 0;  // entries that couldn't be written to disk.
+  };
+
+  // Keeps entries in memory only if @directory is empty. Otherwise creates
+  // @directory if it doesn't exist, and returns nullptr if that fails or the
+  // directory isn't writable.
+  static std::unique_ptr<StageCache> Open(const std::string& directory);
+
+  // Returns a copy of the output of @stage with @key, or nullptr if it is
+  // not cached.
+  std::unique_ptr<CameraSensorData<T>> Get(const std::string& stage,
+                                           const StageKey& key);
+
+  // Caches @data as the output of @stage with @key.
+  void Put(const std::string& stage, const StageKey& key,
+           const CameraSensorData<T>& data);
+
+  std::map<std::string, Stats> stats() const;
+
+  // Prints the hits and misses of every stage.
+  void Print(std::ostream& out) const;
+
+ private:
+  explicit StageCache(std::string directory)
+      : directory_(std::move(directory)) {}
+
+  // Disallow copy and assign.
+  StageCache(StageCache&);
+  void operator=(const StageCache&);
+
+  std::string Path(const std::string& stage, const StageKey& key) const;
+
+  const std::string directory_;
+  mutable std::mutex mutex_;
+  // Guarded by @mutex_.
+  std::map<std::string, std::shared_ptr<const CameraSensorData<T>>> entries_;
+  std::map<std::string, Stats> stats_;
+};
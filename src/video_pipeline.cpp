@@ -0,0 +1,166 @@
+#include "video_pipeline.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include "common.hpp"
+#include "memory_stats.hpp"
+
+namespace {
+constexpr int kMaxHistory = 8;
+
+// Value of @data at (@row, @col), or of its nearest valid same-color
+// neighbor if it is a defect (defects read out outside of [0, 1]).
+template<typename T>
+T ValidValue(const CameraSensorData<T>& data, int row, int col) {
+  const T value = data.data(row, col);
+  if (value <= 1.f) return value;
+  if (col >= 2 && data.data(row, col - 2) <= 1.f) return data.data(row, col - 2);
+  if (col + 2 < data.width() && data.data(row, col + 2) <= 1.f)
+    return data.data(row, col + 2);
+  return 1.f;
+}
+
+double Percentile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) return 0.;
+  const int index = static_cast<int>(p * (sorted.size() - 1) + .5);
+  return sorted[index];
+}
+}  // namespace
+
+VideoPipeline::VideoPipeline(const CameraSensor* sensor, const Opts& opts)
+    : sensor_(sensor),
+      opts_(opts),
+      // The crop is kept to even sizes and offsets so that it starts on the
+      // same Bayer phase as the sensor.
+      width_(std::min(opts.width, sensor->GetSensorWidth()) & ~1),
+      height_(std::min(opts.height, sensor->GetSensorHeight()) & ~1),
+      left_(((sensor->GetSensorWidth() - width_) / 2) & ~1),
+      top_(((sensor->GetSensorHeight() - height_) / 2) & ~1),
+      rgb_(3 * width_ * height_),
+      output_stage_(OutputStage::Opts{1.f, opts.gamma}) {
+  MemoryStats::Stage stage("video");
+  denoised_.reset(new CameraSensorData<T>(width_, height_));
+  const int ring_size = Clamp(opts_.history, 0, kMaxHistory) + 1;
+  for (int i = 0; i < ring_size; i++)
+    ring_.emplace_back(new CameraSensorData<T>(width_, height_));
+  noise_.Reseed();
+}
+
+bool VideoPipeline::Run(int num_frames, FILE* out, Stats* stats) {
+  latencies_ms_.assign(std::max(0, num_frames), 0.);
+  const double frame_ms = 1000. / opts_.target_fps;
+  *stats = Stats();
+
+  Timer clock;
+  for (int frame = 0; frame < num_frames; frame++) {
+    // Frames arrive from the sensor at the target rate; a frame can't be
+    // read before its time, but a slow frame delays the following ones.
+    const double arrival_ms = frame * frame_ms;
+    const double now_ms = clock.ElapsedMs();
+    if (now_ms < arrival_ms) {
+      std::this_thread::sleep_for(
+          std::chrono::duration<double, std::milli>(arrival_ms - now_ms));
+    }
+
+    const double readout_ms = clock.ElapsedMs();
+    sensor_->ReadBurstFrame(frame, left_, top_,
+                            ring_[frame % ring_.size()]->view(), &noise_);
+    const double start_ms = clock.ElapsedMs();
+    stats->readout_mean_ms += (start_ms - readout_ms) / num_frames;
+    ProcessFrame(frame);
+    if (fwrite(rgb_.data(), 1, rgb_.size(), out) != rgb_.size()) return false;
+    const double end_ms = clock.ElapsedMs();
+
+    latencies_ms_[frame] = end_ms - start_ms;
+    if (end_ms > arrival_ms + frame_ms) stats->late_frames++;
+  }
+  stats->frames = num_frames;
+  // Up to when the last frame was due or done, whichever is later: frames
+  // that keep up with the target rate achieve exactly that rate.
+  stats->seconds = std::max(clock.ElapsedMs(), num_frames * frame_ms) / 1000.;
+
+  std::sort(latencies_ms_.begin(), latencies_ms_.end());
+  stats->latency_p50_ms = Percentile(latencies_ms_, .5);
+  stats->latency_p90_ms = Percentile(latencies_ms_, .9);
+  stats->latency_p99_ms = Percentile(latencies_ms_, .99);
+  stats->latency_max_ms = latencies_ms_.empty() ? 0. : latencies_ms_.back();
+  return true;
+}
+
+void VideoPipeline::ProcessFrame(int frame) {
+  const int ring_size = ring_.size();
+  const int current = frame % ring_size;
+  TemporalDenoise(current, std::min(frame, ring_size - 1));
+  DemosaicToRgb8();
+}
+
+void VideoPipeline::TemporalDenoise(int current, int num_previous) {
+  const int ring_size = ring_.size();
+  auto& frame = *ring_[current];
+  const int tile = opts_.tile_size;
+
+  for (int top = 0; top < height_; top += tile) {
+    const int bottom = std::min(height_, top + tile);
+
+    // Fix up defects of the new frame in place, so that it is clean when it
+    // is used as a previous frame later on.
+    for (int row = top; row < bottom; row++) {
+      T* values = &frame.data(row, 0);
+      for (int col = 0; col < width_; col++)
+        if (values[col] > 1.f) values[col] = ValidValue(frame, row, col);
+    }
+
+    for (int left = 0; left < width_; left += tile) {
+      const int right = std::min(width_, left + tile);
+      const int count = (bottom - top) * (right - left);
+
+      // Motion check: only static tiles of previous frames are averaged in.
+      const CameraSensorData<T>* previous[kMaxHistory];
+      int num_static = 0;
+      for (int k = 1; k <= num_previous; k++) {
+        const auto& prev = *ring_[(current - k + ring_size) % ring_size];
+        T sum = 0.f;
+        for (int row = top; row < bottom; row++) {
+          const T* values = &frame.data(row, 0);
+          const T* prev_values = &prev.data(row, 0);
+          for (int col = left; col < right; col++)
+            sum += std::abs(values[col] - prev_values[col]);
+        }
+        if (sum < opts_.motion_threshold * count) previous[num_static++] = &prev;
+      }
+
+      const T scale = 1.f / (1 + num_static);
+      for (int row = top; row < bottom; row++) {
+        const T* values = &frame.data(row, 0);
+        T* out = &denoised_->data(row, 0);
+        for (int col = left; col < right; col++) out[col] = values[col];
+        for (int k = 0; k < num_static; k++) {
+          const T* prev_values = &previous[k]->data(row, 0);
+          for (int col = left; col < right; col++) out[col] += prev_values[col];
+        }
+        for (int col = left; col < right; col++) out[col] *= scale;
+      }
+    }
+  }
+}
+
+void VideoPipeline::DemosaicToRgb8() {
+  // Nearest-quad demosaic: every pixel of a 2x2 Bayer quad (G R / B G) gets
+  // the quad's red, blue and average green. Cheap enough for a viewfinder.
+  const OutputStage& lut = output_stage_;
+  const auto& raw = *denoised_;
+  for (int row = 0; row < height_; row += 2) {
+    unsigned char* out0 = rgb_.data() + 3 * row * width_;
+    unsigned char* out1 = out0 + 3 * width_;
+    for (int col = 0; col < width_; col += 2) {
+      const unsigned char r = lut(raw.data(row, col + 1));
+      const unsigned char g = lut(.5f * (raw.data(row, col) + raw.data(row + 1, col + 1)));
+      const unsigned char b = lut(raw.data(row + 1, col));
+      for (unsigned char* out : {out0 + 3 * col, out1 + 3 * col}) {
+        out[0] = r; out[1] = g; out[2] = b;
+        out[3] = r; out[4] = g; out[5] = b;
+      }
+    }
+  }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include "camera_sensor.hpp"
+#include "output_stage.hpp"
+
+// Continuous capture for a viewfinder or video stream. Frames are read from a
+// crop window of the sensor into a fixed ring buffer, temporally denoised
+// against the previous frames of the ring with a per-tile motion check,
+// demosaiced and gamma corrected into an 8-bit RGB frame. All buffers are
+// allocated up front, so steady-state frames don't allocate.
+class VideoPipeline {
+ public:
+  using T = typename CameraSensor::T;
+
+  struct Opts {
+    // Crop window, centered on the sensor and clamped to its size.
+    int width = 1920;
+    int height = 1080;
+    // Number of previous frames kept for temporal denoising.
+    int history = 3;
+    float target_fps = 30.f;
+    // Motion check: a tile of a previous frame contributes only if its mean
+    // absolute difference to the current frame is below @motion_threshold.
+    int tile_size = 16;
+    T motion_threshold = .03f;
+    float gamma = 1.f / 2.2f;
+  };
+
+  // Latencies are measured from the end of a frame's (simulated) sensor
+  // readout to the end of writing it out; readout time is reported apart.
+  struct Stats {
+    int frames = 0;
+    int late_frames = 0;    // frames that finished after their deadline.
+    // Until the last frame was done or due, whichever is later.
+    double seconds = 0.;
+    double readout_mean_ms = 0.;
+    double latency_p50_ms = 0.;
+    double latency_p90_ms = 0.;
+    double latency_p99_ms = 0.;
+    double latency_max_ms = 0.;
+  };
+
+  VideoPipeline(const CameraSensor* sensor, const Opts& opts);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Captures @num_frames frames paced at the target frame rate and appends
+  // each one to @out as packed 8-bit RGB rows (a raw "rgb24" video stream).
+  // Returns false if writing fails.
+  bool Run(int num_frames, FILE* out, Stats* stats);
+
+ private:
+  // Denoises and converts frame @frame of the ring into rgb_.
+  void ProcessFrame(int frame);
+  void TemporalDenoise(int current, int num_previous);
+  void DemosaicToRgb8();
+
+  // Disallow copy and assign.
+  VideoPipeline(VideoPipeline&);
+  void operator=(const VideoPipeline&);
+
+  const CameraSensor* const sensor_;
+  const Opts opts_;
+  const int width_;
+  const int height_;
+  const int left_;
+  const int top_;
+  std::vector<std::unique_ptr<CameraSensorData<T>>> ring_;
+  std::unique_ptr<CameraSensorData<T>> denoised_;
+  std::vector<unsigned char> rgb_;
+  const OutputStage output_stage_;
+  // Sensor noise of every frame, seeded once so that reading a frame doesn't
+  // reseed from the system.
+  Random noise_;
+  std::vector<double> latencies_ms_;
+};
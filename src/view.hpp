@@ -0,0 +1,66 @@
+#pragma once
+
+#include <type_traits>
+
+// Non-owning view of a 2D array of elements, such as the pixels of an Image
+// or the samples of a CameraSensorData. Rows are @row_stride elements apart,
+// so a view can describe a crop window of a larger buffer without copying
+// it. Multi-channel planar data (e.g. a Halide buffer, or the RGB planes of a
+// scene file) is described by a @channel_stride between channel planes.
+//
+// Views are cheap to copy and pass by value. They don't keep the underlying
+// storage alive: a view must not outlive the buffer it refers to.
+template<typename T> class StridedView {
+ public:
+  StridedView() = default;
+  StridedView(T* data, int width, int height, int row_stride,
+              int channel_stride = 0)
+      : data_(data),
+        width_(width),
+        height_(height),
+        row_stride_(row_stride),
+        channel_stride_(channel_stride) {}
+  StridedView(T* data, int width, int height)
+      : StridedView(data, width, height, width) {}
+
+  // Read-only views can be made from writable ones.
+  template<typename U, typename = typename std::enable_if<
+      std::is_same<T, const U>::value>::type>
+  StridedView(const StridedView<U>& that)
+      : StridedView(that.row(0), that.width(), that.height(),
+                    that.row_stride(), that.channel_stride()) {}
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  int row_stride() const { return row_stride_; }
+  int channel_stride() const { return channel_stride_; }
+
+  T& operator()(int row, int col) const {
+    return data_[row * row_stride_ + col];
+  }
+  T& operator()(int row, int col, int channel) const {
+    return data_[row * row_stride_ + col + channel * channel_stride_];
+  }
+  // Same as operator(), named like CameraSensorData::data() so that code
+  // written against CameraSensorData reads the same with a view.
+  T& data(int row, int col) const { return (*this)(row, col); }
+
+  // Pointer to the first element of @row. Elements of a row are contiguous.
+  T* row(int row) const { return data_ + row * row_stride_; }
+
+  // Returns a view of the crop window at @left, @top of this view.
+  StridedView Crop(int left, int top, int width, int height) const {
+    return StridedView(data_ + top * row_stride_ + left, width, height,
+                       row_stride_, channel_stride_);
+  }
+
+ private:
+  T* data_ = nullptr;
+  int width_ = 0;
+  int height_ = 0;
+  int row_stride_ = 0;
+  int channel_stride_ = 0;
+};
+
+template<typename Pixel> using ImageView = StridedView<Pixel>;
+template<typename T> using SensorView = StridedView<T>;